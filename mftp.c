@@ -6,6 +6,41 @@
 
 #include "mftp.h"
 
+#define RECV_LOCAL -1
+#define RECV_DISCARD -2
+#define CACHE_LIMIT (256LL * 1024 * 1024) // Default size limit of the client cache.
+
+uint32_t nextreqid = 1; // Request id for the next protocol v2 request.
+struct tuning tuning = {"default", 0, 0, 0, 0, 0}; // Socket tuning profile for every connection.
+
+/* Structure: cache
+ * ----------------
+ * The client's cache of fetched files (protocol v3 only) and what it has
+ *	saved so far. cwd is the remote working directory, empty if unknown.
+ *	used is the disk usage of the cache, -1 until it has been scanned.
+ */
+struct cache {
+	char dir[PATH_MAX];
+	long long limit;
+	long long used;
+	char host[256];
+	int port;
+	char cwd[PATH_MAX];
+	long hits;
+	long misses;
+	long long saved;
+} cache = {"", CACHE_LIMIT, -1, "", 0, "", 0, 0, 0};
+
+/* Structure: cacheentry
+ * ---------------------
+ * A cached file considered for eviction.
+ */
+struct cacheentry {
+	char name[17];
+	long long bytes;
+	long long atime;
+};
+
 /* Function: checkerr
  * ------------------
  * Checks a given function return value against it's known error value
@@ -24,16 +59,95 @@ void checkerr(int fret, int eval, char * msg) {
 	}
 }
 
+/* Function: readconfig
+ * --------------------
+ * Reads the client settings from a configuration file: the [client]
+ *	section (port, profile, cache_dir, cache_size) and [profile <name>] sections (sndbuf, rcvbuf,
+ *	nodelay, cork, notsent_lowat) that add to or change the built-in
+ *	default, lan and wan profiles. Server sections are skipped so one file
+ *	can serve both.
+ *
+ * path: configuration file.
+ * port: pointer to store the server port in.
+ * tuning: pointer to store the selected profile in.
+ * cache: pointer to store the cache directory and size limit in.
+ *
+ * returns: 0 on success, -1 on error (after printing a message).
+ */
+int readconfig(char * path, int * port, struct tuning * tuning, struct cache * cache) {
+
+	/* Initialize variables. */
+	char line[CONFIG_LINELEN];
+	char section[CONFIG_LINELEN] = "";
+	char profile[32] = "default";
+	char * key;
+	char * value;
+	int lineno = 0;
+	int result;
+	struct tuning profiles[MAX_PROFILES];
+	int nprofiles = defaultprofiles(profiles);
+
+	FILE * file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "fopen (Client: readconfig): %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while ((result = nextoption(file, section, &key, &value, line, &lineno)) != 0) {
+
+		if (result == -1) break;
+
+		if (key == NULL) {
+
+			/* Start a new profile. */
+			if (strncmp(section, "profile ", 8) == 0 && findprofile(profiles, nprofiles, section + 8) == NULL) {
+				if (nprofiles == MAX_PROFILES || strlen(section + 8) >= sizeof(profiles[0].name)) break;
+				memset(&profiles[nprofiles], 0, sizeof(struct tuning));
+				strcpy(profiles[nprofiles++].name, section + 8);
+			}
+
+		} else if (strcmp(section, "client") == 0) {
+
+			if (strcmp(key, "port") == 0 && atoi(value) > 0 && atoi(value) < 65536) *port = atoi(value);
+			else if (strcmp(key, "profile") == 0) snprintf(profile, 32, "%s", value);
+			else if (strcmp(key, "cache_dir") == 0) snprintf(cache->dir, PATH_MAX, "%s", value);
+			else if (strcmp(key, "cache_size") != 0 || parsesize(value, &cache->limit) == -1) break;
+
+		} else if (strncmp(section, "profile ", 8) == 0) {
+
+			if (settuning(findprofile(profiles, nprofiles, section + 8), key, value) == -1) break;
+
+		}
+	}
+
+	int failed = !feof(file);
+	fclose(file);
+	if (failed) {
+		fprintf(stderr, "readconfig (Client: readconfig): %s:%d: Invalid or unsupported setting\n", path, lineno);
+		return -1;
+	}
+
+	/* Select the profile. */
+	struct tuning * selected = findprofile(profiles, nprofiles, profile);
+	if (selected == NULL) {
+		fprintf(stderr, "readconfig (Client: readconfig): %s: Unknown profile %s\n", path, profile);
+		return -1;
+	}
+	*tuning = *selected;
+	return 0;
+}
+
 /* Function: makeconnection
  * ------------------------
  * Creates a new connection on a specified port number.
  *
  * port: port number for connection.
  * hostname: the hostname for the connection.
+ * which: TUNE_CONTROL or TUNE_DATA, selects the socket options applied.
  *
  * returns: file descriptor for the new connection.
  */
-int makeconnection(unsigned short port, char * hostname) {
+int makeconnection(unsigned short port, char * hostname, int which) {
 
 	/* Create socket. */
 	int socketfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -53,6 +167,9 @@ int makeconnection(unsigned short port, char * hostname) {
 	pptr = (struct in_addr **)hostEntry->h_addr_list;
 	memcpy(&servAddr.sin_addr, *pptr, sizeof(struct in_addr));
 
+	/* Tune the socket before connecting so the buffer sizes affect window scaling. */
+	checkerr(applytuning(socketfd, &tuning, which), -1, "setsockopt (Client: makeconnection)");
+
 	/* Connect to the socket. */
 	checkerr(connect(socketfd, (struct sockaddr *)&servAddr, sizeof(servAddr)), -1,
 		"connect (Client: makeconnection)");
@@ -195,12 +312,12 @@ void executels() {
  *
  * connectfd: file descriptor for connection.
  *
- * returns: address of data connection.
+ * returns: address of data connection, exits if the server refuses one.
  */
 int getaddress(int connectfd) {
 	int address;
 	msghandler(connectfd, "D\n");
-	responsehandler(connectfd, &address);
+	if (!responsehandler(connectfd, &address)) exit(1);
 	return address;
 }
 
@@ -218,7 +335,7 @@ int getaddress(int connectfd) {
 int dataconnect(int connectfd, char * hostname, char * servermsg) {
 	int address = getaddress(connectfd);
 	msghandler(connectfd, servermsg);
-	return makeconnection(address, hostname);
+	return makeconnection(address, hostname, TUNE_DATA);
 }
 
 /* Function: openfile
@@ -260,21 +377,1208 @@ int openfile(char * filename, int flags) {
 	return myfd;
 }
 
-/* Function: readwrite
+/* Function: makedirs
+ * ------------------
+ * Creates a directory and any missing parents.
+ *
+ * path: path of the directory.
+ *
+ * returns: 0 on success, -1 on error.
+ */
+int makedirs(char * path) {
+
+	char buffer[PATH_MAX];
+	snprintf(buffer, PATH_MAX, "%s", path);
+
+	for (char * slash = buffer + 1; *slash; slash++) {
+		if (*slash != '/') continue;
+		*slash = '\0';
+		if (mkdir(buffer, S_IRWXU) == -1 && errno != EEXIST) return -1;
+		*slash = '/';
+	}
+	if (mkdir(buffer, S_IRWXU) == -1 && errno != EEXIST) return -1;
+
+	return 0;
+}
+
+/* Function: cachelookup
+ * -----------------------
+ * Finds the cache file for a file on the server. Files are keyed by the
+ *	server, the remote working directory and the path, and the cache file
+ *	keeps the size and modification time of the remote file it holds.
+ *
+ * name: path of the file on the server.
+ * path: buffer of PATH_MAX bytes for the path of the cache file.
+ * size: pointer to store the size of the cached copy in (-1 if none).
+ * mtime: pointer to store the modification time of the cached copy in,
+ *	in nanoseconds (-1 if none).
+ *
+ * returns: 0 on success, -1 if caching is off, the remote working
+ *	directory is unknown or the cache directory's path is too long.
+ */
+int cachelookup(char * name, char * path, long long * size, long long * mtime) {
+
+	char key[PATH_MAX * 2];
+	struct stat cachestat;
+
+	if (cache.limit <= 0 || !cache.cwd[0] || makedirs(cache.dir) == -1) return -1;
+
+	if (name[0] == '/') snprintf(key, PATH_MAX * 2, "%s:%d:%s", cache.host, cache.port, name);
+	else snprintf(key, PATH_MAX * 2, "%s:%d:%s/%s", cache.host, cache.port, cache.cwd, name);
+	if (snprintf(path, PATH_MAX, "%s/%016llx", cache.dir, (unsigned long long)hashbytes(key, strlen(key))) >= PATH_MAX) {
+		return -1;
+	}
+
+	*size = *mtime = -1;
+	if (stat(path, &cachestat) == 0) {
+		*size = cachestat.st_size;
+		*mtime = cachestat.st_mtim.tv_sec * 1000000000LL + cachestat.st_mtim.tv_nsec;
+	}
+	return 0;
+}
+
+/* Function: cachecopy
+ * -------------------
+ * Copies a cached file out of the cache and marks it as recently used.
+ *
+ * cachefd: file descriptor for the cache file.
+ * outfd: file descriptor to copy to.
+ * sparse: whether outfd is a new file that holes can be left in.
+ *
+ * returns: number of bytes copied or -1 on error.
+ */
+long long cachecopy(int cachefd, int outfd, int sparse) {
+
+	char buffer[65536];
+	long long total = 0;
+	off_t hole = 0;
+	ssize_t rnum;
+
+	while (1) {
+		rnum = sparse ? sparseread(cachefd, buffer, 65536, &hole) : read(cachefd, buffer, 65536);
+		if (hole > 0) {
+			if (lseek(outfd, hole, SEEK_CUR) == -1) return -1;
+			total += hole;
+		}
+		if (rnum <= 0) break;
+		if (writedata(outfd, buffer, rnum) == -1) return -1;
+		total += rnum;
+	}
+	if (rnum == -1 || (sparse && ftruncate(outfd, lseek(outfd, 0, SEEK_CUR)) == -1)) return -1;
+
+	struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+	futimens(cachefd, times);
+	return total;
+}
+
+/* Function: compareaccess
+ * -----------------------
+ * Orders cache entries from least to most recently used for qsort.
+ *
+ * a: pointer to the first entry.
+ * b: pointer to the second entry.
+ *
+ * returns: negative, zero or positive like strcmp.
+ */
+int compareaccess(const void * a, const void * b) {
+	const struct cacheentry * first = a;
+	const struct cacheentry * second = b;
+	if (first->atime != second->atime) return first->atime < second->atime ? -1 : 1;
+	return 0;
+}
+
+/* Function: cacheevict
+ * --------------------
+ * Accounts for a file added to the cache and removes the least recently
+ *	used files once the cache no longer fits in its size limit. The cache
+ *	directory is only scanned the first time and when the running total
+ *	goes over the limit.
+ *
+ * added: disk usage of the file added.
+ *
+ * returns: void.
+ */
+void cacheevict(long long added) {
+
+	/* Nothing to do while the cache still fits. */
+	if (cache.used >= 0) {
+		cache.used += added;
+		if (cache.used <= cache.limit) return;
+	}
+
+	/* Initialize variables. */
+	struct cacheentry * entries = NULL;
+	int count = 0, size = 0;
+	long long total = 0;
+	struct dirent * entry;
+
+	DIR * dir = opendir(cache.dir);
+	if (dir == NULL) return;
+
+	/* Collect every cached file with its disk usage and last use. */
+	while ((entry = readdir(dir)) != NULL) {
+		struct stat cachestat;
+		if (strlen(entry->d_name) != 16 || fstatat(dirfd(dir), entry->d_name, &cachestat, AT_SYMLINK_NOFOLLOW) == -1 ||
+			!S_ISREG(cachestat.st_mode)) continue;
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			struct cacheentry * grown = realloc(entries, size * sizeof(struct cacheentry));
+			if (grown == NULL) break;
+			entries = grown;
+		}
+		memcpy(entries[count].name, entry->d_name, 17);
+		entries[count].bytes = (long long)cachestat.st_blocks * 512;
+		entries[count].atime = cachestat.st_atim.tv_sec * 1000000000LL + cachestat.st_atim.tv_nsec;
+		total += entries[count++].bytes;
+	}
+
+	/* Remove the oldest until the rest fit. */
+	if (total > cache.limit) {
+		qsort(entries, count, sizeof(struct cacheentry), compareaccess);
+		for (int i = 0; i < count && total > cache.limit; i++) {
+			if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) total -= entries[i].bytes;
+		}
+	}
+	cache.used = total;
+
+	closedir(dir);
+	free(entries);
+}
+
+/* Structure: transfer
+ * -------------------
+ * A protocol v2 request whose data is being received by the client. A
+ *	cached request also copies its data to cachefd until it is complete,
+ *	size and mtime describe what the server is sending. A failed request
+ *	has been cancelled and only waits for the end of its stream.
+ */
+struct transfer {
+	uint32_t reqid;
+	char * remote;
+	char * name;
+	int fd;
+	int done;
+	int failed;
+	int sparse;
+	long consumed;
+	struct timespec start;
+	char * cachefile;
+	char * cachetemp;
+	int cachefd;
+	long long size;
+	long long mtime;
+};
+
+/* Structure: benchstats
+ * ---------------------
+ * Latency and throughput figures collected by the bench command.
+ */
+struct benchstats {
+	long requests;
+	long long bytes;
+	double total;
+	double min;
+	double max;
+};
+
+/* Function: elapsed
+ * -----------------
+ * Computes the time elapsed since a starting point.
+ *
+ * start: starting point (CLOCK_MONOTONIC).
+ *
+ * returns: elapsed time in seconds.
+ */
+double elapsed(struct timespec * start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Function: recordlatency
+ * -----------------------
+ * Adds a completed request to a set of bench statistics.
+ *
+ * stats: statistics to update (may be NULL).
+ * latency: latency of the request in seconds.
+ *
+ * returns: void.
+ */
+void recordlatency(struct benchstats * stats, double latency) {
+	if (stats == NULL) return;
+	if (!stats->requests || latency < stats->min) stats->min = latency;
+	if (latency > stats->max) stats->max = latency;
+	stats->total += latency;
+	stats->requests++;
+}
+
+/* Function: requestv2
+ * -------------------
+ * Sends a protocol v2 request and waits for the server to acknowledge it.
+ *	Frames left over from earlier requests are skipped.
+ *
+ * connectfd: file descriptor for connection.
+ * reqid: request id.
+ * type: request frame type.
+ * flags: (optional) pointer to the request flags, replaced by the flags of
+ *	the acknowledgement.
+ * arg: request argument (may be NULL).
+ * reply: (optional) buffer for the payload of the acknowledgement.
+ * replylen: length of reply.
+ *
+ * returns: 0 on server error, 1 otherwise.
+ */
+int requestv2(int connectfd, uint32_t reqid, uint8_t type, uint8_t * flags, char * arg, char * reply, int replylen) {
+
+	/* Initialize variables. */
+	struct frame frame;
+	char * payload = malloc(FRAME_MAXLEN + 1);
+	int result = 0;
+	if (payload == NULL) {
+		fprintf(stderr, "malloc (Client: requestv2): Out of memory\n");
+		exit(1);
+	}
+
+	/* Send the request and wait for its response. */
+	writeframe(connectfd, reqid, type, flags == NULL ? 0 : *flags, arg, arg == NULL ? 0 : strlen(arg));
+	while (readframe(connectfd, &frame, payload)) {
+		if (frame.reqid != reqid) continue;
+		if (frame.type == FRAME_ACK) {
+			if (flags != NULL) *flags = frame.flags;
+			if (reply != NULL) snprintf(reply, replylen, "%s", payload);
+			result = 1;
+			break;
+		} else if (frame.type == FRAME_ERR) {
+			printf("SERVER: %s\n", payload);
+			break;
+		}
+	}
+
+	free(payload);
+	return result;
+}
+
+/* Function: dropcache
+ * --------------------
+ * Throws away the partial cache copy of a transfer, the transfer itself
+ *	carries on without it.
+ *
+ * mytransfer: transfer whose cache copy to drop.
+ *
+ * returns: void.
+ */
+void dropcache(struct transfer * mytransfer) {
+	if (mytransfer->cachefd >= 0) {
+		close(mytransfer->cachefd);
+		unlink(mytransfer->cachetemp);
+	}
+	mytransfer->cachefd = -1;
+}
+
+/* Function: droptransfer
+ * ----------------------
+ * Throws away what a transfer has received so far: the partial local file
+ *	and the partial cache copy.
+ *
+ * mytransfer: transfer to drop.
+ * outfd: file descriptor the transfer writes to (see receivev2).
+ *
+ * returns: void.
+ */
+void droptransfer(struct transfer * mytransfer, int outfd) {
+	if (outfd == RECV_LOCAL && mytransfer->fd >= 0) {
+		close(mytransfer->fd);
+		unlink(mytransfer->name);
+	}
+	dropcache(mytransfer);
+	mytransfer->fd = -1;
+}
+
+/* Function: failtransfer
+ * ----------------------
+ * Gives up on a transfer whose output can't be written: reports it, drops
+ *	what was received and, unless the stream is already over, asks the
+ *	server to stop sending.
+ *
+ * connectfd: file descriptor for connection.
+ * mytransfer: transfer that failed (errno tells why).
+ * outfd: file descriptor the transfer writes to (see receivev2).
+ * cancel: whether to cancel the stream.
+ *
+ * returns: void.
+ */
+void failtransfer(int connectfd, struct transfer * mytransfer, int outfd, int cancel) {
+	printf("ERROR: Cannot write %s (%s)\n", mytransfer->name == NULL ? "output" : mytransfer->name, strerror(errno));
+	if (cancel) writeframe(connectfd, mytransfer->reqid, FRAME_CANCEL, 0, NULL, 0);
+	droptransfer(mytransfer, outfd);
+	mytransfer->failed = 1;
+}
+
+/* Function: receivev2
+ * -------------------
+ * Sends a protocol v2 request for each name and receives the multiplexed
+ *	data streams until every request has completed.
+ *
+ * connectfd: file descriptor for connection.
+ * type: request frame type (FRAME_GET or FRAME_LS).
+ * names: request arguments.
+ * locals: (optional) local file for each request with RECV_LOCAL, the
+ *	request arguments are used if NULL.
+ * count: number of requests.
+ * outfd: file descriptor all data is written to, RECV_LOCAL to write each
+ *	stream to a local file (sparse files are fetched with their holes), or
+ *	RECV_DISCARD.
+ * cached: whether to serve files from the cache when the server says they
+ *	have not changed and to cache the ones that are fetched.
+ * stats: (optional) statistics to record request latencies in.
+ *
+ * returns: number of requests that completed successfully.
+ */
+int receivev2(int connectfd, uint8_t type, char ** names, char ** locals, int count, int outfd, int cached,
+	struct benchstats * stats) {
+
+	/* Initialize variables. */
+	struct transfer * transfers = calloc(count, sizeof(struct transfer));
+	char * payload = malloc(FRAME_MAXLEN + 1);
+	int pending = count;
+	int completed = 0;
+	if (transfers == NULL || payload == NULL) {
+		fprintf(stderr, "malloc (Client: receivev2): Out of memory\n");
+		exit(1);
+	}
+
+	/* Send every request up front. */
+	uint8_t flags = type == FRAME_GET && outfd == RECV_LOCAL ? FRAME_SPARSE : 0;
+	for (int i = 0; i < count; i++) {
+		char path[PATH_MAX];
+		long long size, mtime;
+		transfers[i].reqid = nextreqid++;
+		transfers[i].remote = names[i];
+		transfers[i].name = locals == NULL ? names[i] : locals[i];
+		transfers[i].fd = -1;
+		transfers[i].cachefd = -1;
+		clock_gettime(CLOCK_MONOTONIC, &transfers[i].start);
+		if (cached && type == FRAME_GET && names[i] != NULL && cachelookup(names[i], path, &size, &mtime) == 0) {
+			transfers[i].cachefile = strdup(path);
+			snprintf(payload, FRAME_MAXLEN, "%lld %lld %s", size, mtime, names[i]);
+			writeframe(connectfd, transfers[i].reqid, type, flags | FRAME_COND, payload, strlen(payload));
+		} else {
+			writeframe(connectfd, transfers[i].reqid, type, flags, names[i], names[i] == NULL ? 0 : strlen(names[i]));
+		}
+	}
+
+	/* Dispatch frames to their transfers until they are all done. */
+	while (pending > 0) {
+
+		struct frame frame;
+		if (!readframe(connectfd, &frame, payload)) {
+			fprintf(stderr, "readframe (Client: receivev2): Connection closed\n");
+			exit(1);
+		}
+
+		struct transfer * mytransfer = NULL;
+		for (int i = 0; i < count; i++) {
+			if (transfers[i].reqid == frame.reqid && !transfers[i].done) mytransfer = &transfers[i];
+		}
+		if (mytransfer == NULL) continue;
+
+		if (frame.type == FRAME_ERR) {
+
+			/* The request failed, possibly part way through its stream. */
+			printf("SERVER: %s\n", payload);
+			droptransfer(mytransfer, outfd);
+			mytransfer->done = 1;
+			pending--;
+
+		} else if (frame.type == FRAME_ACK && (frame.flags & FRAME_COND) && strcmp(payload, "=") == 0) {
+
+			/* The cached copy is current, ask for the whole file again if it was evicted since. */
+			int cachefd = mytransfer->cachefile == NULL ? -1 : open(mytransfer->cachefile, O_RDONLY);
+			if (cachefd == -1) {
+				snprintf(payload, FRAME_MAXLEN, "-1 -1 %s", mytransfer->remote);
+				writeframe(connectfd, frame.reqid, type, flags | FRAME_COND, payload, strlen(payload));
+				continue;
+			}
+
+			/* Copy it out instead of receiving the file. */
+			int myfd = outfd == RECV_LOCAL ? openfile(mytransfer->name, O_WRONLY | O_CREAT | O_EXCL) : outfd;
+			long long copied = myfd >= 0 ? cachecopy(cachefd, myfd, outfd == RECV_LOCAL) : -1;
+			if (copied >= 0) {
+				cache.saved += copied;
+				cache.hits++;
+				completed++;
+			} else if (myfd >= 0) {
+				printf("ERROR: Cannot copy %s from the cache (%s)\n", mytransfer->name == NULL ? "output" :
+					mytransfer->name, strerror(errno));
+			}
+			if (outfd == RECV_LOCAL && myfd >= 0) {
+				fchmod(myfd, S_IRUSR | S_IWUSR);
+				close(myfd);
+				if (copied == -1) unlink(mytransfer->name);
+			}
+			close(cachefd);
+			recordlatency(stats, elapsed(&mytransfer->start));
+			mytransfer->done = 1;
+			pending--;
+
+		} else if (frame.type == FRAME_ACK) {
+
+			/* Open the file for writing, creating if it doesn't exist, cancelling the request otherwise. */
+			if (outfd == RECV_LOCAL) {
+				mytransfer->fd = openfile(mytransfer->name, O_WRONLY | O_CREAT | O_EXCL);
+				if (mytransfer->fd == -1) writeframe(connectfd, frame.reqid, FRAME_CANCEL, 0, NULL, 0);
+			} else if (outfd >= 0) {
+				mytransfer->fd = outfd;
+			}
+			mytransfer->sparse = frame.flags & FRAME_SPARSE;
+
+			/* Copy the file into the cache as it arrives if the server said what it is sending. */
+			if (mytransfer->cachefile != NULL) {
+				cache.misses++;
+				if (mytransfer->fd >= 0 && (frame.flags & FRAME_COND) &&
+					sscanf(payload, "%lld %lld", &mytransfer->size, &mytransfer->mtime) == 2 &&
+					mytransfer->size <= cache.limit &&
+					asprintf(&mytransfer->cachetemp, "%s.%d.part", mytransfer->cachefile, getpid()) != -1) {
+					mytransfer->cachefd = open(mytransfer->cachetemp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+				}
+			}
+
+		} else if (frame.type == FRAME_HOLE) {
+
+			/* Leave a hole in the file by skipping over it. */
+			uint64_t length;
+			if (!mytransfer->sparse || mytransfer->fd < 0 || frame.length != 8) continue;
+			memcpy(&length, payload, 8);
+			if (lseek(mytransfer->fd, be64toh(length), SEEK_CUR) == -1) {
+				failtransfer(connectfd, mytransfer, outfd, 1);
+				continue;
+			}
+			if (mytransfer->cachefd >= 0 && lseek(mytransfer->cachefd, be64toh(length), SEEK_CUR) == -1) {
+				dropcache(mytransfer);
+			}
+
+		} else if (frame.type == FRAME_DATA) {
+
+			/* Write the data out, giving up on the request if that fails. */
+			if (mytransfer->failed) continue;
+			if (mytransfer->fd >= 0 && writedata(mytransfer->fd, payload, frame.length) == -1) {
+				failtransfer(connectfd, mytransfer, outfd, 1);
+				continue;
+			}
+			if (mytransfer->cachefd >= 0 && writedata(mytransfer->cachefd, payload, frame.length) == -1) {
+				dropcache(mytransfer); // Only the cached copy is lost.
+			}
+
+			/* Hand credit back once half the window is used. */
+			if (stats != NULL) stats->bytes += frame.length;
+			mytransfer->consumed += frame.length;
+			if (mytransfer->consumed >= FRAME_WINDOW / 2) {
+				uint32_t increment = htonl(mytransfer->consumed);
+				writeframe(connectfd, frame.reqid, FRAME_WINDOWUPD, 0, &increment, 4);
+				mytransfer->consumed = 0;
+			}
+
+		} else if (frame.type == FRAME_END) {
+
+			/* Extend the file over any trailing hole, set permissions on it and close it. */
+			if (!mytransfer->failed && outfd == RECV_LOCAL && mytransfer->fd >= 0 && mytransfer->sparse &&
+				ftruncate(mytransfer->fd, lseek(mytransfer->fd, 0, SEEK_CUR)) == -1) {
+				failtransfer(connectfd, mytransfer, outfd, 0);
+			}
+			if (mytransfer->failed) {
+				mytransfer->done = 1;
+				pending--;
+				continue;
+			}
+			if (outfd == RECV_LOCAL && mytransfer->fd >= 0) {
+				fchmod(mytransfer->fd, S_IRUSR | S_IWUSR);
+				close(mytransfer->fd);
+				completed++;
+			} else if (outfd != RECV_LOCAL) {
+				completed++;
+			}
+
+			/* Move the cached copy into place with the file's modification time if it is complete. */
+			if (mytransfer->cachefd >= 0) {
+				off_t end = lseek(mytransfer->cachefd, 0, SEEK_CUR);
+				struct stat cachestat;
+				struct timespec times[2] = {{0, UTIME_NOW},
+					{mytransfer->mtime / 1000000000LL, mytransfer->mtime % 1000000000LL}};
+				if (end == mytransfer->size && ftruncate(mytransfer->cachefd, end) == 0 &&
+					futimens(mytransfer->cachefd, times) == 0 && fstat(mytransfer->cachefd, &cachestat) == 0 &&
+					rename(mytransfer->cachetemp, mytransfer->cachefile) == 0) {
+					cacheevict((long long)cachestat.st_blocks * 512);
+				} else {
+					unlink(mytransfer->cachetemp);
+				}
+				close(mytransfer->cachefd);
+			}
+			recordlatency(stats, elapsed(&mytransfer->start));
+			mytransfer->done = 1;
+			pending--;
+
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		free(transfers[i].cachefile);
+		free(transfers[i].cachetemp);
+	}
+	free(transfers);
+	free(payload);
+	return completed;
+}
+
+/* Function: putfilev2
+ * -------------------
+ * Sends a local file to the server over a protocol v2 connection, waiting
+ *	for window updates whenever the credit runs out. If the server agrees,
+ *	holes in the file are sent as HOLE frames instead of zeros. The server
+ *	acknowledges the end of the file once it is stored, or sends an error
+ *	as soon as it can't store it.
+ *
+ * connectfd: file descriptor for connection.
+ * myfd: file descriptor for the local file.
+ * name: name of the file on the server.
+ *
+ * returns: 1 if the server stored the file, 0 otherwise.
+ */
+int putfilev2(int connectfd, int myfd, char * name) {
+
+	/* Initialize variables. */
+	uint32_t reqid = nextreqid++;
+	uint8_t flags = FRAME_SPARSE;
+	long credit = FRAME_WINDOW;
+	int done = 0, result = 0, corked = 0;
+	struct frame frame;
+	char * payload = malloc(FRAME_MAXLEN + 1);
+	if (payload == NULL) {
+		fprintf(stderr, "malloc (Client: putfilev2): Out of memory\n");
+		exit(1);
+	}
+
+	/* Wait for acknowledgement, or fail if the client receives an error. */
+	if (!requestv2(connectfd, reqid, FRAME_PUT, &flags, name, NULL, 0)) {
+		free(payload);
+		return 0;
+	}
+
+	/* Frames go out corked while there is credit and are pushed before waiting for more. */
+	while (!done) {
+		if (credit > 0) {
+			if (!corked) {
+				corkframes(connectfd, &tuning, 1);
+				corked = 1;
+			}
+			long rlen = credit < FRAME_MAXLEN ? credit : FRAME_MAXLEN;
+			off_t hole = 0;
+			ssize_t rnum = flags & FRAME_SPARSE ? sparseread(myfd, payload, rlen, &hole) : read(myfd, payload, rlen);
+			checkerr(rnum, -1, "read (Client: putfilev2)");
+			if (hole > 0) {
+				uint64_t length = htobe64(hole);
+				writeframe(connectfd, reqid, FRAME_HOLE, 0, &length, 8);
+			}
+			if (!rnum) {
+				writeframe(connectfd, reqid, FRAME_END, 0, NULL, 0);
+				corkframes(connectfd, &tuning, 0);
+				done = 1;
+				continue;
+			}
+			writeframe(connectfd, reqid, FRAME_DATA, 0, payload, rnum);
+			credit -= rnum;
+		} else {
+			uint32_t increment;
+			if (corked) {
+				corkframes(connectfd, &tuning, 0);
+				corked = 0;
+			}
+			if (!readframe(connectfd, &frame, payload)) {
+				fprintf(stderr, "readframe (Client: putfilev2): Connection closed\n");
+				exit(1);
+			}
+			if (frame.reqid != reqid) continue;
+			if (frame.type == FRAME_ERR) {
+				printf("SERVER: %s\n", payload);
+				free(payload);
+				return 0;
+			}
+			if (frame.type != FRAME_WINDOWUPD || frame.length != 4) continue;
+			memcpy(&increment, payload, 4);
+			credit += ntohl(increment);
+		}
+	}
+
+	/* Wait for the server to confirm the file was stored. */
+	while (readframe(connectfd, &frame, payload)) {
+		if (frame.reqid != reqid || frame.type == FRAME_WINDOWUPD) continue;
+		if (frame.type == FRAME_ERR) printf("SERVER: %s\n", payload);
+		result = frame.type == FRAME_ACK;
+		break;
+	}
+
+	free(payload);
+	return result;
+}
+
+/* Function: startmore
+ * -------------------
+ * Starts the command more -20 reading from a new pipe.
+ *
+ * pid: pointer to store the process id of more in.
+ *
+ * returns: file descriptor for the write end of the pipe.
+ */
+int startmore(pid_t * pid) {
+
+	int pipefd[2];
+	checkerr(pipe(pipefd), -1, "pipe (Client: startmore)");
+
+	*pid = fork();
+	checkerr(*pid, -1, "fork (Client: startmore)");
+
+	if (!*pid) {
+		close(pipefd[1]); // Close write end.
+		checkerr(dup2(pipefd[0], STDIN_FILENO), -1, "dup2 (Client: startmore)");
+		close(pipefd[0]);
+		executecmd("more", "-20");
+	}
+
+	close(pipefd[0]); // Close read end.
+	return pipefd[1];
+}
+
+/* Function: showv2
+ * ----------------
+ * Receives a single protocol v2 stream and pipes it to more -20. Files
+ *	come from the cache when the server says they have not changed.
+ *
+ * connectfd: file descriptor for connection.
+ * type: request frame type (FRAME_GET or FRAME_LS).
+ * name: request argument (may be NULL).
+ *
+ * returns: void.
+ */
+void showv2(int connectfd, uint8_t type, char * name) {
+	pid_t pid;
+	int pipefd = startmore(&pid);
+	receivev2(connectfd, type, &name, NULL, 1, pipefd, type == FRAME_GET, NULL);
+	close(pipefd);
+	waitpid(pid, NULL, 0);
+}
+
+/* Function: negotiate
  * -------------------
- * Reads from one file descriptor and writes to another one character at a
- * 	time.
+ * Asks the server to switch to a newer protocol version. Servers that
+ *	predate protocol v2 reject the request as invalid input and the
+ *	connection stays on v1, any other error (such as a busy server turning
+ *	the connection away) is fatal.
+ *
+ * connectfd: file descriptor for connection.
+ * version: highest protocol version wanted.
+ *
+ * returns: protocol version in use.
+ */
+int negotiate(int connectfd, int version) {
+
+	char servermsg[32] = {0};
+	char response[256] = {0};
+
+	if (version < 2) return 1;
+
+	snprintf(servermsg, 32, "V%d\n", version);
+	msghandler(connectfd, servermsg);
+	if (!readhandler(connectfd, response, 256)) {
+		fprintf(stderr, "read (Client: negotiate): Connection closed\n");
+		exit(1);
+	}
+
+	if (response[0] == 'E' && strncmp(response + 1, "Invalid input", 13) != 0) {
+		printf("SERVER: %s", response + 1);
+		exit(1);
+	}
+	if (response[0] == 'E') {
+
+		/* Old servers echo the request with its newline, leaving an empty line to skip before the next reply. */
+		struct pollfd fds = {connectfd, POLLIN, 0};
+		if (strstr(response, servermsg) != NULL && poll(&fds, 1, 1000) == 1) readhandler(connectfd, response, 256);
+		return 1;
+	}
+	if (response[0] != 'A' || atoi(response + 1) < 2) return 1;
+
+	/* Stream data now shares the control connection. */
+	checkerr(applytuning(connectfd, &tuning, TUNE_STREAM), -1, "setsockopt (Client: negotiate)");
+	return atoi(response + 1);
+}
+
+/* Function: benchrun
+ * ------------------
+ * Repeatedly fetches a file over a connection and reports the request rate
+ *	and latency of its protocol. With protocol v2, depth requests are kept
+ *	outstanding at once.
+ *
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for data connections.
+ * version: protocol version of the connection.
+ * count: number of requests to make.
+ * name: name of the file to fetch.
+ * depth: number of outstanding requests (v2 only).
+ *
+ * returns: requests completed per second.
+ */
+double benchrun(int connectfd, char * hostname, int version, int count, char * name, int depth) {
+
+	/* Initialize variables. */
+	struct benchstats stats = {0};
+	struct timespec start;
+	char servermsg[512] = {0};
+	char ** names = malloc(depth * sizeof(char *));
+	int nullfd = open("/dev/null", O_WRONLY);
+	checkerr(nullfd, -1, "open (Client: benchrun)");
+	if (names == NULL) {
+		fprintf(stderr, "malloc (Client: benchrun): Out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < depth; i++) names[i] = name;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (version >= 2) {
+		for (int sent = 0; sent < count; sent += depth) {
+			int batch = count - sent < depth ? count - sent : depth;
+			receivev2(connectfd, FRAME_GET, names, NULL, batch, RECV_DISCARD, 0, &stats);
+		}
+	} else {
+		snprintf(servermsg, 512, "G%.500s\n", name);
+		for (int i = 0; i < count; i++) {
+			struct timespec reqstart;
+			clock_gettime(CLOCK_MONOTONIC, &reqstart);
+			int datafd = dataconnect(connectfd, hostname, servermsg);
+			if (!responsehandler(connectfd, NULL)) {
+				close(datafd);
+				break;
+			}
+			long long bytes = readwrite(datafd, nullfd);
+			close(datafd);
+			if (bytes == -1) break;
+			stats.bytes += bytes;
+			recordlatency(&stats, elapsed(&reqstart));
+		}
+	}
+
+	double total = elapsed(&start);
+	double rate = total > 0 ? stats.requests / total : 0.0;
+	printf("v%d: %ld requests in %.3f s (%.1f req/s, %lld bytes)\n", version, stats.requests, total, rate, stats.bytes);
+	if (stats.requests) {
+		printf("v%d: latency avg %.3f ms, min %.3f ms, max %.3f ms\n", version,
+			stats.total / stats.requests * 1e3, stats.min * 1e3, stats.max * 1e3);
+	}
+
+	close(nullfd);
+	free(names);
+	return rate;
+}
+
+/* Function: bench
+ * ---------------
+ * Compares the protocols by running the same benchmark over a new v1
+ *	connection and a new connection using the newest protocol the server
+ *	supports. Both copy file data in FRAME_MAXLEN byte pieces, so only the
+ *	protocols differ.
+ *
+ * hostname: hostname of the server.
+ * port: port of the server.
+ * count: number of requests to make per protocol.
+ * name: name of the file to fetch.
+ * depth: number of outstanding requests (v2 only).
+ *
+ * returns: void.
+ */
+void bench(char * hostname, int port, int count, char * name, int depth) {
+
+	double rates[2] = {0, 0};
+	int versions[2] = {1, PROTO_VERSION};
+
+	for (int i = 0; i < 2; i++) {
+
+		/* Connect as a new client would and move to the session's remote working directory if it is known. */
+		char servermsg[PATH_MAX + 8];
+		int connectfd = makeconnection(port, hostname, TUNE_CONTROL);
+		int version = negotiate(connectfd, versions[i]);
+		int ready = version == versions[i] || version >= 2;
+		if (ready && cache.cwd[0] && version >= 2) {
+			ready = requestv2(connectfd, nextreqid++, FRAME_CD, NULL, cache.cwd, NULL, 0);
+		} else if (ready && cache.cwd[0]) {
+			snprintf(servermsg, sizeof(servermsg), "C%s\n", cache.cwd);
+			msghandler(connectfd, servermsg);
+			ready = responsehandler(connectfd, NULL);
+		}
+		if (version != versions[i] && version < 2) printf("v%d: Not supported by the server\n", versions[i]);
+		else if (ready) rates[i] = benchrun(connectfd, hostname, version, count, name, depth);
+
+		/* Hang up. */
+		if (version >= 2) {
+			requestv2(connectfd, nextreqid++, FRAME_QUIT, NULL, NULL, NULL, 0);
+		} else {
+			msghandler(connectfd, "Q\n");
+			responsehandler(connectfd, NULL);
+		}
+		close(connectfd);
+	}
+
+	if (rates[0] > 0 && rates[1] > 0) printf("v%d/v1: %.2fx the request rate\n", PROTO_VERSION, rates[1] / rates[0]);
+}
+
+/* Function: findargs
+ * ------------------
+ * Turns the arguments of the find command into the arguments of a find
+ *	request: <maxdepth> <limit> <minsize> <maxsize> <newer> <older> <glob>
+ *	<path>. Usage: find [path] [-name glob] [-size [+|-]N[k|m|g]]
+ *	[-mtime [+|-]days] [-maxdepth N] [-limit N]
+ *
+ * args: buffer for the request arguments.
+ * arglen: length of args.
+ *
+ * returns: 0 on success, -1 if the arguments are invalid (after printing
+ *	a message).
+ */
+int findargs(char * args, int arglen) {
+
+	/* Initialize variables. */
+	char * path = ".";
+	char * glob = "*";
+	int maxdepth = -1;
+	long long limit = -1, minsize = -1, maxsize = -1, newer = -1, older = -1;
+	char * token;
+
+	while ((token = strtok(NULL, " \t\n")) != NULL) {
+
+		if (token[0] != '-') {
+			path = token;
+			continue;
+		}
+
+		char * value = strtok(NULL, " \t\n");
+		long long number;
+		if (value == NULL) {
+			printf("ERROR: Missing value for %s\n", token);
+			return -1;
+		}
+
+		if (strcmp(token, "-name") == 0) {
+			glob = value;
+		} else if (strcmp(token, "-maxdepth") == 0 && parsesize(value, &number) == 0) {
+			maxdepth = number;
+		} else if (strcmp(token, "-limit") == 0 && parsesize(value, &number) == 0) {
+			limit = number;
+		} else if (strcmp(token, "-size") == 0 && parsesize(value + (*value == '+' || *value == '-'), &number) == 0) {
+			if (*value == '+') minsize = number + 1;
+			else if (*value == '-') maxsize = number > 0 ? number - 1 : 0;
+			else minsize = maxsize = number;
+		} else if (strcmp(token, "-mtime") == 0 && parsesize(value + (*value == '+' || *value == '-'), &number) == 0) {
+			if (*value == '+') older = (number + 1) * 86400;
+			else if (*value == '-') newer = number * 86400;
+			else older = number * 86400, newer = (number + 1) * 86400;
+		} else {
+			printf("ERROR: Invalid option (%s %s)\n", token, value);
+			return -1;
+		}
+	}
+
+	snprintf(args, arglen, "%d %lld %lld %lld %lld %lld %s %s", maxdepth, limit, minsize, maxsize,
+		newer, older, glob, path);
+	return 0;
+}
+
+/* Function: tailargs
+ * ------------------
+ * Turns the arguments of the show -f command into the arguments of a tail
+ *	request: <count> <l|c> <path>. Usage: show -f [-n lines | -c bytes]
+ *	<file>
+ *
+ * args: buffer for the request arguments.
+ * arglen: length of args.
+ *
+ * returns: 0 on success, -1 if the arguments are invalid (after printing
+ *	a message).
+ */
+int tailargs(char * args, int arglen) {
+
+	/* Initialize variables. */
+	char * path = NULL;
+	long long count = 10;
+	char unit = 'l';
+	char * token;
+
+	while ((token = strtok(NULL, " \t\n")) != NULL) {
+
+		if (strcmp(token, "-n") != 0 && strcmp(token, "-c") != 0) {
+			path = token;
+			continue;
+		}
+
+		char * value = strtok(NULL, " \t\n");
+		if (value == NULL || parsesize(value, &count) == -1) {
+			printf("ERROR: Invalid value for %s\n", token);
+			return -1;
+		}
+		unit = token[1] == 'n' ? 'l' : 'c';
+	}
+
+	if (path == NULL) {
+		printf("ERROR: Usage: show -f [-n lines | -c bytes] <file>\n");
+		return -1;
+	}
+
+	snprintf(args, arglen, "%lld %c %s", count, unit, path);
+	return 0;
+}
+
+/* Function: follow
+ * ----------------
+ * Prints a file on the server and everything appended to it as it grows
+ *	until the user presses enter. Under protocol v1 the file arrives over
+ *	a data connection that is closed to stop, under v2 over a stream that
+ *	is cancelled to stop.
  *
- * readfd: file descriptor for reading.
- * writefd: file descriptor for writing.
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for data connections.
+ * version: protocol version in use.
+ * args: tail request arguments (see tailargs).
  *
  * returns: void.
  */
-void readwrite(int readfd, int writefd) {
-	char nextc;
-	while(read(readfd, &nextc, 1)) {
-		write(writefd, &nextc, 1);
+void follow(int connectfd, char * hostname, int version, char * args) {
+
+	/* Initialize variables. */
+	char servermsg[512] = {0};
+	char line[256];
+	uint32_t reqid = nextreqid++;
+	int datafd = -1;
+	int stopped = 0;
+	long consumed = 0;
+	char * payload = malloc(FRAME_MAXLEN + 1);
+	if (payload == NULL) {
+		fprintf(stderr, "malloc (Client: follow): Out of memory\n");
+		exit(1);
+	}
+
+	/* Start following, or fail if the client receives an error. */
+	if (version >= 2) {
+		if (!requestv2(connectfd, reqid, FRAME_TAIL, NULL, args, NULL, 0)) {
+			free(payload);
+			return;
+		}
+	} else {
+		snprintf(servermsg, 512, "T%s\n", args);
+		datafd = dataconnect(connectfd, hostname, servermsg);
+		if (!responsehandler(connectfd, NULL)) {
+			close(datafd);
+			free(payload);
+			return;
+		}
+	}
+	printf("Following, press enter to stop\n");
+	fflush(stdout);
+
+	while (1) {
+
+		/* Wait for data or for the user. */
+		struct pollfd fds[2] = {{version >= 2 ? connectfd : datafd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+		checkerr(poll(fds, stopped ? 1 : 2, -1), -1, "poll (Client: follow)");
+
+		/* Stop on enter: close the data connection, or cancel the stream and wait for its end. */
+		if (!stopped && fds[1].revents) {
+			fgets(line, 256, stdin);
+			if (version < 2) break;
+			writeframe(connectfd, reqid, FRAME_CANCEL, 0, NULL, 0);
+			stopped = 1;
+		}
+		if (!fds[0].revents) continue;
+
+		if (version < 2) {
+			ssize_t rnum = read(datafd, payload, FRAME_MAXLEN);
+			if (rnum <= 0) break;
+			write(STDOUT_FILENO, payload, rnum);
+			continue;
+		}
+
+		struct frame frame;
+		if (!readframe(connectfd, &frame, payload)) {
+			fprintf(stderr, "readframe (Client: follow): Connection closed\n");
+			exit(1);
+		}
+		if (frame.reqid != reqid) continue;
+		if (frame.type == FRAME_END) break;
+		if (frame.type != FRAME_DATA) continue;
+
+		/* Print the data and hand credit back once half the window is used. */
+		write(STDOUT_FILENO, payload, frame.length);
+		consumed += frame.length;
+		if (consumed >= FRAME_WINDOW / 2) {
+			uint32_t increment = htonl(consumed);
+			writeframe(connectfd, reqid, FRAME_WINDOWUPD, 0, &increment, 4);
+			consumed = 0;
+		}
+	}
+
+	if (datafd != -1) close(datafd);
+	free(payload);
+}
+
+/* Function: mirror
+ * ----------------
+ * Makes a local directory match a directory on the server. Both sides
+ *	build a manifest of their files and only files that are new or whose
+ *	content hash changed are fetched, many at once under protocol v2. Files
+ *	are fetched next to their destination and renamed into place once
+ *	complete. Local files missing on the server are left alone.
+ *
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for data connections.
+ * version: protocol version in use.
+ * remote: directory on the server.
+ * local: local directory.
+ * usecache: whether both sides should use their manifest caches.
+ *
+ * returns: void.
+ */
+void mirror(int connectfd, char * hostname, int version, char * remote, char * local, int usecache) {
+
+	/* Initialize variables. */
+	char args[PATH_MAX + 16];
+	char servermsg[512] = {0};
+	struct manifest remotemanifest, localmanifest;
+	int nfetch = 0, fetched = 0;
+	long long bytes = 0;
+	FILE * file = tmpfile();
+	if (file == NULL) checkerr(-1, -1, "tmpfile (Client: mirror)");
+	fflush(stdout);
+
+	/* Fetch the server's manifest. */
+	snprintf(args, sizeof(args), "%d %s", usecache, remote);
+	if (version >= 2) {
+		char * name = args;
+		if (receivev2(connectfd, FRAME_MIRROR, &name, NULL, 1, fileno(file), 0, NULL) != 1) {
+			fclose(file);
+			return;
+		}
+	} else {
+		snprintf(servermsg, 512, "M%.500s\n", args);
+		int datafd = dataconnect(connectfd, hostname, servermsg);
+		if (!responsehandler(connectfd, NULL)) {
+			close(datafd);
+			fclose(file);
+			return;
+		}
+		long long received = readwrite(datafd, fileno(file));
+		close(datafd);
+		if (received == -1) {
+			printf("ERROR: Cannot receive the manifest of %s (%s)\n", remote, strerror(errno));
+			fclose(file);
+			return;
+		}
+	}
+	lseek(fileno(file), 0, SEEK_SET);
+	readmanifest(file, &remotemanifest);
+	fclose(file);
+
+	/* Build the local manifest. */
+	int rootfd = -1;
+	if (makedirs(local) == -1 || (rootfd = open(local, O_RDONLY | O_DIRECTORY)) == -1) {
+		printf("ERROR: Invalid pathname (%s)\n", local);
+		freemanifest(&remotemanifest);
+		return;
+	}
+	int hashed = buildmanifest(rootfd, &localmanifest, usecache);
+	close(rootfd);
+
+	/* Work out which files are new or changed. */
+	char ** names = calloc(remotemanifest.count + 1, sizeof(char *));
+	char ** temps = calloc(remotemanifest.count + 1, sizeof(char *));
+	struct manifestentry ** entries = calloc(remotemanifest.count + 1, sizeof(struct manifestentry *));
+	if (names == NULL || temps == NULL || entries == NULL) {
+		fprintf(stderr, "calloc (Client: mirror): Out of memory\n");
+		exit(1);
+	}
+	for (int i = 0; i < remotemanifest.count; i++) {
+
+		struct manifestentry * entry = &remotemanifest.entries[i];
+		struct manifestentry * mine = findentry(&localmanifest, entry->path);
+		if (mine != NULL && mine->hashed && mine->hash == entry->hash && mine->size == entry->size) continue;
+
+		/* Never write outside the local directory, whatever the server sent. */
+		if (!validpath(entry->path)) {
+			printf("ERROR: Skipping unsafe path %s\n", entry->path);
+			continue;
+		}
+
+		if (asprintf(&names[nfetch], "%s/%s", remote, entry->path) == -1 ||
+			asprintf(&temps[nfetch], "%s/%s.mftp-part", local, entry->path) == -1) {
+			fprintf(stderr, "asprintf (Client: mirror): Out of memory\n");
+			exit(1);
+		}
+
+		/* Make room for the file. */
+		char * slash = strrchr(temps[nfetch], '/');
+		*slash = '\0';
+		makedirs(temps[nfetch]);
+		*slash = '/';
+		unlink(temps[nfetch]);
+
+		entries[nfetch++] = entry;
+	}
+
+	/* Fetch them. */
+	if (version >= 2) {
+		for (int i = 0; i < nfetch; i += MAX_STREAMS) {
+			int batch = nfetch - i < MAX_STREAMS ? nfetch - i : MAX_STREAMS;
+			receivev2(connectfd, FRAME_GET, names + i, temps + i, batch, RECV_LOCAL, 0, NULL);
+		}
+	} else {
+		for (int i = 0; i < nfetch; i++) {
+			snprintf(servermsg, 512, "G%.500s\n", names[i]);
+			int datafd = dataconnect(connectfd, hostname, servermsg);
+			if (!responsehandler(connectfd, NULL)) {
+				close(datafd);
+				continue;
+			}
+			int myfd = openfile(temps[i], O_WRONLY | O_CREAT | O_EXCL);
+			if (myfd != -1) {
+				readwrite(datafd, myfd);
+				fchmod(myfd, S_IRUSR | S_IWUSR);
+				close(myfd);
+			}
+			close(datafd);
+		}
 	}
+
+	/* Move complete files into place with the server's modification time. */
+	for (int i = 0; i < nfetch; i++) {
+		struct stat filestat;
+		char * final = strndup(temps[i], strlen(temps[i]) - strlen(".mftp-part"));
+		if (final != NULL && stat(temps[i], &filestat) == 0 && filestat.st_size == entries[i]->size &&
+			rename(temps[i], final) == 0) {
+			struct timespec times[2] = {{0, UTIME_OMIT},
+				{entries[i]->mtime / 1000000000LL, entries[i]->mtime % 1000000000LL}};
+			utimensat(AT_FDCWD, final, times, 0);
+			bytes += filestat.st_size;
+			fetched++;
+		} else {
+			unlink(temps[i]);
+		}
+		free(final);
+		free(names[i]);
+		free(temps[i]);
+	}
+
+	printf("Mirrored %s to %s: %d files, %d changed, %d fetched (%lld bytes), %d hashed locally\n", remote, local,
+		remotemanifest.count, nfetch, fetched, bytes, hashed);
+
+	free(names);
+	free(temps);
+	free(entries);
+	freemanifest(&remotemanifest);
+	freemanifest(&localmanifest);
 }
 
 /* Function: clienthandler
@@ -283,10 +1587,12 @@ void readwrite(int readfd, int writefd) {
  *
  * connectfd: file descriptor for the connection.
  * hostname: hostname for the connection.
+ * port: port of the connection.
+ * version: protocol version in use.
  *
  * returns: void.
  */
-void clienthandler(int connectfd, char * hostname) {
+void clienthandler(int connectfd, char * hostname, int port, int version) {
 
 	while (1) {
 
@@ -312,6 +1618,11 @@ void clienthandler(int connectfd, char * hostname) {
 		/* Handle input. */
 		if (strcmp(token, "exit") == 0) {
 
+			if (version >= 2) {
+				requestv2(connectfd, nextreqid++, FRAME_QUIT, NULL, NULL, NULL, 0);
+				break;
+			}
+
 			msghandler(connectfd, "Q\n");
 			responsehandler(connectfd, NULL);
 			break;
@@ -324,6 +1635,13 @@ void clienthandler(int connectfd, char * hostname) {
 		} else if (strcmp(token, "rcd") == 0) {
 
 			token = strtok(NULL, " \t\n");
+
+			/* Remember where we are on the server, the cache is keyed by it. */
+			if (version >= 2) {
+				requestv2(connectfd, nextreqid++, FRAME_CD, NULL, token, version >= 3 ? cache.cwd : NULL, PATH_MAX);
+				continue;
+			}
+
 			snprintf(servermsg, 512, "C%s\n", token);
 			msghandler(connectfd, servermsg);
 			responsehandler(connectfd, NULL);
@@ -334,6 +1652,11 @@ void clienthandler(int connectfd, char * hostname) {
 
 		} else if (strcmp(token, "rls") == 0) {
 
+			if (version >= 2) {
+				showv2(connectfd, FRAME_LS, NULL);
+				continue;
+			}
+
 			int datafd = dataconnect(connectfd, hostname, "L\n");
 			responsehandler(connectfd, NULL);
 			executemore(datafd);
@@ -343,6 +1666,21 @@ void clienthandler(int connectfd, char * hostname) {
 			/* Get the filename. */
 			token = strtok(NULL, " \t\n");
 
+			/* With protocol v2, fetch the named files over the control connection, MAX_STREAMS at a time. */
+			if (version >= 2) {
+				char * names[sizeof(buffer) / 2 + 1];
+				int count = 0;
+				while (token != NULL) {
+					names[count++] = token;
+					token = strtok(NULL, " \t\n");
+				}
+				for (int i = 0; i < count; i += MAX_STREAMS) {
+					receivev2(connectfd, FRAME_GET, names + i, NULL, count - i < MAX_STREAMS ? count - i : MAX_STREAMS,
+						RECV_LOCAL, 1, NULL);
+				}
+				continue;
+			}
+
 			/* Open the data connection with the server and run get. */
 			snprintf(servermsg, 512, "G%s\n", token);
 			int datafd = dataconnect(connectfd, hostname, servermsg);
@@ -354,8 +1692,11 @@ void clienthandler(int connectfd, char * hostname) {
 			int myfd = openfile(token, O_WRONLY | O_CREAT | O_EXCL);
 			if (myfd == -1) continue;
 
-			/* Read from the data connection and write to the file. */
-			readwrite(datafd, myfd);
+			/* Read from the data connection and write to the file, removing what arrived if that fails. */
+			if (readwrite(datafd, myfd) == -1) {
+				printf("ERROR: Cannot receive %s (%s)\n", token, strerror(errno));
+				unlink(token);
+			}
 
 			/* Close the data connection, set permissions on the file, and close the file. */
 			close(datafd);
@@ -367,6 +1708,19 @@ void clienthandler(int connectfd, char * hostname) {
 			/* Get the filename. */
 			token = strtok(NULL, " \t\n");
 
+			/* Follow the file as it grows instead of paging through it. */
+			if (token != NULL && strcmp(token, "-f") == 0) {
+				char args[500] = {0};
+				if (tailargs(args, 500) == -1) continue;
+				follow(connectfd, hostname, version, args);
+				continue;
+			}
+
+			if (version >= 2) {
+				showv2(connectfd, FRAME_GET, token);
+				continue;
+			}
+
 			/* Open the data connection with the server and run get. */
 			snprintf(servermsg, 512, "G%s\n", token);
 			int datafd = dataconnect(connectfd, hostname, servermsg);
@@ -386,6 +1740,12 @@ void clienthandler(int connectfd, char * hostname) {
 			int myfd = openfile(token, O_RDONLY);
 			if (myfd == -1) continue;
 
+			if (version >= 2) {
+				putfilev2(connectfd, myfd, token);
+				close(myfd);
+				continue;
+			}
+
 			/* Open the data connection with the server and run put. */
 			snprintf(servermsg, 512, "P%s\n", token);
 			int datafd = dataconnect(connectfd, hostname, servermsg);
@@ -400,6 +1760,65 @@ void clienthandler(int connectfd, char * hostname) {
 			close(datafd);
 			close(myfd);
 
+		} else if (strcmp(token, "find") == 0) {
+
+			/* Build the search from the remaining arguments. */
+			char args[500] = {0};
+			if (findargs(args, 500) == -1) continue;
+			fflush(stdout);
+
+			/* Stream the matches straight to stdout as the server finds them. */
+			if (version >= 2) {
+				char * name = args;
+				receivev2(connectfd, FRAME_FIND, &name, NULL, 1, STDOUT_FILENO, 0, NULL);
+				continue;
+			}
+
+			snprintf(servermsg, 512, "F%s\n", args);
+			int datafd = dataconnect(connectfd, hostname, servermsg);
+
+			/* Wait for acknowledgement, or fail if the client receives an error. */
+			if (!responsehandler(connectfd, NULL)) {
+				close(datafd);
+				continue;
+			}
+
+			readwrite(datafd, STDOUT_FILENO);
+			close(datafd);
+
+		} else if (strcmp(token, "mirror") == 0) {
+
+			/* Get the options and the directories, the local one defaults to the remote one. */
+			int usecache = 0;
+			token = strtok(NULL, " \t\n");
+			if (token != NULL && strcmp(token, "-c") == 0) {
+				usecache = 1;
+				token = strtok(NULL, " \t\n");
+			}
+			char * local = strtok(NULL, " \t\n");
+			if (token == NULL) {
+				printf("ERROR: Usage: mirror [-c] <remote dir> [local dir]\n");
+				continue;
+			}
+
+			mirror(connectfd, hostname, version, token, local == NULL ? token : local, usecache);
+
+		} else if (strcmp(token, "bench") == 0) {
+
+			/* Get the request count, the filename and the number of outstanding requests. */
+			char * count = strtok(NULL, " \t\n");
+			char * file = strtok(NULL, " \t\n");
+			char * depth = strtok(NULL, " \t\n");
+			if (count == NULL || file == NULL || atoi(count) < 1) {
+				printf("ERROR: Usage: bench <count> <file> [depth]\n");
+				continue;
+			}
+			int mydepth = depth == NULL ? 1 : atoi(depth);
+			if (mydepth < 1) mydepth = 1;
+			if (mydepth > MAX_STREAMS) mydepth = MAX_STREAMS;
+
+			bench(hostname, port, atoi(count), file, mydepth);
+
 		} else {
 
 			printf("ERROR: Invalid input (%s)\n", token);
@@ -411,23 +1830,50 @@ void clienthandler(int connectfd, char * hostname) {
 /* Main Function */
 int main(int argc, char * argv[]) {
 
+	/* Parse options. */
+	int version = PROTO_VERSION;
+	int port = PORT_NUM;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:v:")) != -1) {
+		if (opt == 'c' && readconfig(optarg, &port, &tuning, &cache) == -1) exit(1);
+		else if (opt == 'v') version = atoi(optarg);
+		else if (opt != 'c') version = -1;
+	}
+
 	/* Check number of arguments. */
-	if (argc != 2) {
+	if (argc - optind != 1 || version < 1) {
 		fprintf(stderr, "argv (Client: main): Incorrect number of arguments\n");
-		printf("Usage: ./%s <host>\n", argv[0]);
+		printf("Usage: %s [-c <config file>] [-v <protocol version>] <host>\n", argv[0]);
 		exit(1);
 	}
+	char * hostname = argv[optind];
 
 	/* Create control connection. */
-	int port = PORT_NUM;
-	int connectfd = makeconnection(port, argv[1]);
+	int connectfd = makeconnection(port, hostname, TUNE_CONTROL);
 	printf("Connection established on port %d\n", port);
 
+	/* Negotiate the protocol version. */
+	version = negotiate(connectfd, version);
+	printf("Using protocol v%d\n", version);
+
+	/* Find the remote working directory for the cache and bench, which protocol v3 reports. */
+	if (!cache.dir[0] && getenv("XDG_CACHE_HOME") != NULL) snprintf(cache.dir, PATH_MAX, "%s/mftp", getenv("XDG_CACHE_HOME"));
+	else if (!cache.dir[0] && getenv("HOME") != NULL) snprintf(cache.dir, PATH_MAX, "%s/.cache/mftp", getenv("HOME"));
+	snprintf(cache.host, 256, "%s", hostname);
+	cache.port = port;
+	if (version >= 3) requestv2(connectfd, nextreqid++, FRAME_CD, NULL, ".", cache.cwd, PATH_MAX);
+
 	/* Handle input and send to the connection. */
-	clienthandler(connectfd, argv[1]);
+	clienthandler(connectfd, hostname, port, version);
 
 	/* Close the connection. */
 	close(connectfd);
 
+	/* Report what the cache saved. */
+	if (cache.hits + cache.misses > 0) {
+		printf("Cache: %ld hits, %ld misses (%.0f%% hit rate), %lld bytes not transferred\n", cache.hits, cache.misses,
+			100.0 * cache.hits / (cache.hits + cache.misses), cache.saved);
+	}
+
 	return 0;
 }
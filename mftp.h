@@ -6,21 +6,166 @@
 
 #ifndef MFTP_H
 
+/* Must come before any system header: asprintf, fallocate, ppoll, SEEK_DATA and friends. */
+#define _GNU_SOURCE
+
 #define MFTP_H
 #define PORT_NUM 49999
+#define PROTO_VERSION 3
+
+/* Protocol v2 frames: a FRAME_HDRLEN byte header (payload length, request id,
+ *	type, flags and two reserved bytes, all in network byte order) followed
+ *	by up to FRAME_MAXLEN bytes of payload. */
+#define FRAME_HDRLEN 12
+#define FRAME_MAXLEN 65536
+#define FRAME_WINDOW (256 * 1024)
+#define MAX_STREAMS 64
+
+/* Configuration limits. */
+#define MAX_PROFILES 16
+#define MAX_LISTENERS 16
+#define CONFIG_LINELEN 512
+
+/* Name of the manifest cache kept at the root of a mirrored directory. */
+#define MANIFEST_CACHE ".mftpmanifest"
+
+/* Which socket options a tuning profile applies (see applytuning). */
+#define TUNE_LISTEN 0
+#define TUNE_CONTROL 1
+#define TUNE_DATA 2
+#define TUNE_STREAM 3
+
+/* Request frame types share their letters with the v1 commands. */
+#define FRAME_CD 'C'
+#define FRAME_LS 'L'
+#define FRAME_GET 'G'
+#define FRAME_FIND 'F'
+#define FRAME_MIRROR 'M'
+#define FRAME_PUT 'P'
+#define FRAME_TAIL 'T'
+#define FRAME_QUIT 'Q'
+#define FRAME_ACK 'A'
+#define FRAME_ERR 'E'
+#define FRAME_DATA 'd'
+#define FRAME_END 'e'
+#define FRAME_WINDOWUPD 'w'
+#define FRAME_CANCEL 'x'
+#define FRAME_HOLE 'h'
+
+/* Frame flags. FRAME_SPARSE on a GET or PUT request asks for HOLE frames
+ *	(an 8 byte length to skip) in place of runs of zeros, the ACK carries
+ *	it back if the server agrees. FRAME_COND (protocol v3) on a GET request
+ *	prefixes the path with the size and mtime (in nanoseconds, -1 for none)
+ *	of a cached copy. Its ACK carries FRAME_COND and either "=" when the
+ *	copy is current, with no stream following, or the file's size and
+ *	mtime. */
+#define FRAME_SPARSE 0x01
+#define FRAME_COND 0x02
 
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/openat2.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+/* A socket tuning profile. Zero leaves the system default in place. */
+struct tuning {
+	char name[32];
+	int sndbuf;
+	int rcvbuf;
+	int nodelay;
+	int cork;
+	int notsentlowat;
+};
+
+struct frame {
+	uint32_t length;
+	uint32_t reqid;
+	uint8_t type;
+	uint8_t flags;
+};
+
+/* Streaming XXH64 state (see mftpmanifest.c). */
+struct hashstate {
+	uint64_t lanes[4];
+	uint64_t seed;
+	uint64_t total;
+	unsigned char buffer[32];
+	size_t buflen;
+};
+
+/* A file in a directory manifest. mtime is in nanoseconds. */
+struct manifestentry {
+	char * path;
+	long long size;
+	long long mtime;
+	dev_t dev;
+	ino_t ino;
+	uint64_t hash;
+	int hashed;
+};
+
+struct manifest {
+	struct manifestentry * entries;
+	int count;
+	int size;
+};
+
+/* mftpframe.c */
+void writeall(int fd, struct iovec * iov, int iovcnt);
+int writedata(int fd, const void * buffer, size_t len);
+int readall(int fd, void * buffer, size_t len);
+void writeframe(int connectfd, uint32_t reqid, uint8_t type, uint8_t flags, const void * payload, uint32_t length);
+int readframe(int connectfd, struct frame * frame, char * payload);
+long long readwrite(int readfd, int writefd);
+ssize_t sparseread(int myfd, char * buffer, size_t len, off_t * hole);
+int opennofollow(int dirfd, char * path, int flags);
+
+/* mftpconfig.c */
+int parsesize(char * value, long long * size);
+int defaultprofiles(struct tuning * profiles);
+struct tuning * findprofile(struct tuning * profiles, int nprofiles, char * name);
+int settuning(struct tuning * tuning, char * key, char * value);
+int applytuning(int socketfd, struct tuning * tuning, int which);
+void corkframes(int socketfd, struct tuning * tuning, int on);
+int nextoption(FILE * file, char * section, char ** key, char ** value, char * line, int * lineno);
+
+/* mftpmanifest.c */
+void hashinit(struct hashstate * state, uint64_t seed);
+void hashupdate(struct hashstate * state, const void * data, size_t len);
+uint64_t hashdigest(struct hashstate * state);
+uint64_t hashbytes(const void * data, size_t len);
+int buildmanifest(int rootfd, struct manifest * manifest, int usecache);
+int writemanifest(int outfd, struct manifest * manifest);
+int validpath(char * path);
+void readmanifest(FILE * file, struct manifest * manifest);
+struct manifestentry * findentry(struct manifest * manifest, char * path);
+void freemanifest(struct manifest * manifest);
+
 #endif
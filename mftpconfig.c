@@ -0,0 +1,188 @@
+/* CS 360 (Systems Programming) -- Final Project
+ * 	written by Shawn Hillstrom
+ * ---------------------------------------------
+ * Configuration files and socket tuning shared by client and server.
+ */
+
+#include "mftp.h"
+
+/* Function: parsesize
+ * -------------------
+ * Parses a size with an optional k, m or g suffix.
+ *
+ * value: string to parse.
+ * size: pointer to store the size in.
+ *
+ * returns: 0 on success, -1 if the value is not a valid size.
+ */
+int parsesize(char * value, long long * size) {
+	char * end;
+	errno = 0;
+	long long parsed = strtoll(value, &end, 10);
+	if (errno || end == value || parsed < 0) return -1;
+	if (*end == 'k' || *end == 'K') parsed <<= 10, end++;
+	else if (*end == 'm' || *end == 'M') parsed <<= 20, end++;
+	else if (*end == 'g' || *end == 'G') parsed <<= 30, end++;
+	if (*end != '\0') return -1;
+	*size = parsed;
+	return 0;
+}
+
+/* Function: defaultprofiles
+ * -------------------------
+ * Fills in the built-in tuning profiles: default (system defaults), lan
+ *	(low latency) and wan (large buffers for long fat links).
+ *
+ * profiles: array of at least 3 profiles.
+ *
+ * returns: number of profiles filled in.
+ */
+int defaultprofiles(struct tuning * profiles) {
+	struct tuning builtin[] = {
+		{"default", 0, 0, 0, 0, 0},
+		{"lan", 0, 0, 1, 0, 0},
+		{"wan", 16 << 20, 16 << 20, 1, 1, 128 << 10},
+	};
+	memcpy(profiles, builtin, sizeof(builtin));
+	return sizeof(builtin) / sizeof(builtin[0]);
+}
+
+/* Function: findprofile
+ * ---------------------
+ * Finds a tuning profile by name.
+ *
+ * profiles: array of profiles.
+ * nprofiles: number of profiles.
+ * name: name of the profile.
+ *
+ * returns: pointer to the profile or NULL if there is none by that name.
+ */
+struct tuning * findprofile(struct tuning * profiles, int nprofiles, char * name) {
+	for (int i = 0; i < nprofiles; i++) {
+		if (strcmp(profiles[i].name, name) == 0) return &profiles[i];
+	}
+	return NULL;
+}
+
+/* Function: settuning
+ * -------------------
+ * Sets one option of a tuning profile from a configuration file.
+ *
+ * tuning: profile to change.
+ * key: name of the option.
+ * value: value of the option.
+ *
+ * returns: 0 on success, -1 if the option or value is invalid.
+ */
+int settuning(struct tuning * tuning, char * key, char * value) {
+	long long size;
+	if (parsesize(value, &size) == -1 || size > INT32_MAX) return -1;
+	if (strcmp(key, "sndbuf") == 0) tuning->sndbuf = size;
+	else if (strcmp(key, "rcvbuf") == 0) tuning->rcvbuf = size;
+	else if (strcmp(key, "nodelay") == 0) tuning->nodelay = size != 0;
+	else if (strcmp(key, "cork") == 0) tuning->cork = size != 0;
+	else if (strcmp(key, "notsent_lowat") == 0) tuning->notsentlowat = size;
+	else return -1;
+	return 0;
+}
+
+/* Function: applytuning
+ * ---------------------
+ * Applies a tuning profile to a socket. Buffer sizes apply to every socket
+ *	(and must be set before listen or connect to affect window scaling),
+ *	TCP_NODELAY only to v1 control connections, TCP_CORK and
+ *	TCP_NOTSENT_LOWAT only to data connections. A control connection that
+ *	negotiated protocol v2 carries the data of its streams, so it always
+ *	gets TCP_NODELAY, takes TCP_NOTSENT_LOWAT like a data connection and is
+ *	corked around each batch of frames (see corkframes).
+ *
+ * socketfd: file descriptor for the socket.
+ * tuning: profile to apply.
+ * which: TUNE_LISTEN, TUNE_CONTROL, TUNE_DATA or TUNE_STREAM.
+ *
+ * returns: 0 on success, -1 if an option could not be set.
+ */
+int applytuning(int socketfd, struct tuning * tuning, int which) {
+	int nodelay = 1;
+	if (tuning->sndbuf &&
+		setsockopt(socketfd, SOL_SOCKET, SO_SNDBUF, &tuning->sndbuf, sizeof(int)) == -1) return -1;
+	if (tuning->rcvbuf &&
+		setsockopt(socketfd, SOL_SOCKET, SO_RCVBUF, &tuning->rcvbuf, sizeof(int)) == -1) return -1;
+	if (which == TUNE_CONTROL && tuning->nodelay &&
+		setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &tuning->nodelay, sizeof(int)) == -1) return -1;
+	if (which == TUNE_STREAM &&
+		setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int)) == -1) return -1;
+	if (which == TUNE_DATA && tuning->cork &&
+		setsockopt(socketfd, IPPROTO_TCP, TCP_CORK, &tuning->cork, sizeof(int)) == -1) return -1;
+	if ((which == TUNE_DATA || which == TUNE_STREAM) && tuning->notsentlowat &&
+		setsockopt(socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tuning->notsentlowat, sizeof(int)) == -1) return -1;
+	return 0;
+}
+
+/* Function: corkframes
+ * --------------------
+ * Corks or uncorks a control connection that carries protocol v2 streams
+ *	if its tuning profile asks for TCP_CORK, so a batch of frames leaves in
+ *	full segments and is pushed out as soon as the batch is done.
+ *
+ * socketfd: file descriptor for the connection.
+ * tuning: profile of the connection.
+ * on: 1 to cork before a batch, 0 to uncork after it.
+ *
+ * returns: void.
+ */
+void corkframes(int socketfd, struct tuning * tuning, int on) {
+	if (tuning->cork) setsockopt(socketfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+}
+
+/* Function: nextoption
+ * --------------------
+ * Reads the next section header or key = value line from a configuration
+ *	file, skipping blank lines and # comments.
+ *
+ * file: configuration file.
+ * section: buffer holding the current section (updated on headers).
+ * key: pointer to store the key in (NULL for a section header).
+ * value: pointer to store the value in.
+ * line: line buffer of CONFIG_LINELEN bytes the key and value point into.
+ * lineno: pointer to the current line number.
+ *
+ * returns: 1 if a line was read, 0 at end of file, -1 on a malformed line.
+ */
+int nextoption(FILE * file, char * section, char ** key, char ** value, char * line, int * lineno) {
+
+	while (fgets(line, CONFIG_LINELEN, file) != NULL) {
+
+		(*lineno)++;
+
+		/* Strip comments and surrounding whitespace. */
+		char * start = line;
+		char * hash = strchr(line, '#');
+		if (hash != NULL) *hash = '\0';
+		while (isspace((unsigned char)*start)) start++;
+		char * end = start + strlen(start);
+		while (end > start && isspace((unsigned char)end[-1])) *--end = '\0';
+		if (*start == '\0') continue;
+
+		/* Section header. */
+		if (*start == '[') {
+			if (end[-1] != ']') return -1;
+			end[-1] = '\0';
+			snprintf(section, CONFIG_LINELEN, "%s", start + 1);
+			*key = NULL;
+			return 1;
+		}
+
+		/* key = value */
+		char * equals = strchr(start, '=');
+		if (equals == NULL) return -1;
+		*value = equals + 1;
+		while (equals > start && isspace((unsigned char)equals[-1])) equals--;
+		*equals = '\0';
+		while (isspace((unsigned char)**value)) (*value)++;
+		*key = start;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,244 @@
+/* CS 360 (Systems Programming) -- Final Project
+ * 	written by Shawn Hillstrom
+ * ---------------------------------------------
+ * Protocol v2 frames and file descriptor I/O (sparse files included) shared
+ *	by client and server.
+ */
+
+#include "mftp.h"
+
+/* Function: writeall
+ * ------------------
+ * Writes a set of buffers to a file descriptor, retrying on short writes.
+ *
+ * fd: file descriptor to write to.
+ * iov: buffers to write (modified in place).
+ * iovcnt: number of buffers.
+ *
+ * returns: void.
+ */
+void writeall(int fd, struct iovec * iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t wnum = writev(fd, iov, iovcnt);
+		if (wnum == -1) {
+			fprintf(stderr, "writev (Frame: writeall): %s\n", strerror(errno));
+			exit(1);
+		}
+		while (iovcnt > 0 && (size_t)wnum >= iov->iov_len) {
+			wnum -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + wnum;
+			iov->iov_len -= wnum;
+		}
+	}
+}
+
+/* Function: writedata
+ * -------------------
+ * Writes a buffer to a file descriptor, retrying on short writes.
+ *
+ * fd: file descriptor to write to.
+ * buffer: data to write.
+ * len: length of data.
+ *
+ * returns: 0 on success, -1 on error.
+ */
+int writedata(int fd, const void * buffer, size_t len) {
+	for (size_t index = 0; index < len; ) {
+		ssize_t wnum = write(fd, (const char *)buffer + index, len - index);
+		if (wnum == -1 && errno == EINTR) continue;
+		if (wnum == -1) return -1;
+		index += wnum;
+	}
+	return 0;
+}
+
+/* Function: readall
+ * -----------------
+ * Reads exactly len bytes from a file descriptor.
+ *
+ * fd: file descriptor to read from.
+ * buffer: read buffer.
+ * len: number of bytes to read.
+ *
+ * returns: 1 on success, 0 if EOF is encountered first.
+ */
+int readall(int fd, void * buffer, size_t len) {
+	size_t index = 0;
+	while (index < len) {
+		ssize_t rnum = read(fd, (char *)buffer + index, len - index);
+		if (rnum == -1) {
+			fprintf(stderr, "read (Frame: readall): %s\n", strerror(errno));
+			exit(1);
+		}
+		if (!rnum) return 0;
+		index += rnum;
+	}
+	return 1;
+}
+
+/* Function: writeframe
+ * --------------------
+ * Sends a protocol v2 frame over a connection.
+ *
+ * connectfd: file descriptor for connection.
+ * reqid: request id the frame belongs to.
+ * type: frame type.
+ * flags: frame flags.
+ * payload: frame payload (may be NULL if length is 0).
+ * length: length of the payload.
+ *
+ * returns: void.
+ */
+void writeframe(int connectfd, uint32_t reqid, uint8_t type, uint8_t flags, const void * payload, uint32_t length) {
+	unsigned char header[FRAME_HDRLEN] = {0};
+	uint32_t nlength = htonl(length);
+	uint32_t nreqid = htonl(reqid);
+	memcpy(header, &nlength, 4);
+	memcpy(header + 4, &nreqid, 4);
+	header[8] = type;
+	header[9] = flags;
+
+	struct iovec iov[2] = {{header, FRAME_HDRLEN}, {(void *)payload, length}};
+	writeall(connectfd, iov, length ? 2 : 1);
+}
+
+/* Function: readframe
+ * -------------------
+ * Reads the next protocol v2 frame from a connection. The payload is NUL
+ *	terminated so text payloads can be used directly.
+ *
+ * connectfd: file descriptor for connection.
+ * frame: structure to store the frame header in.
+ * payload: buffer of at least FRAME_MAXLEN + 1 bytes for the payload.
+ *
+ * returns: 1 on success, 0 if the connection was closed.
+ */
+int readframe(int connectfd, struct frame * frame, char * payload) {
+	unsigned char header[FRAME_HDRLEN];
+	uint32_t nvalue;
+
+	if (!readall(connectfd, header, FRAME_HDRLEN)) return 0;
+	memcpy(&nvalue, header, 4);
+	frame->length = ntohl(nvalue);
+	memcpy(&nvalue, header + 4, 4);
+	frame->reqid = ntohl(nvalue);
+	frame->type = header[8];
+	frame->flags = header[9];
+
+	if (frame->length > FRAME_MAXLEN) {
+		fprintf(stderr, "readframe (Frame: readframe): Frame too large (%u)\n", frame->length);
+		exit(1);
+	}
+
+	if (!readall(connectfd, payload, frame->length)) return 0;
+	payload[frame->length] = '\0';
+	return 1;
+}
+
+/* Function: readwrite
+ * -------------------
+ * Reads from one file descriptor and writes to another until EOF, a
+ *	protocol v2 frame's worth (FRAME_MAXLEN bytes) at a time.
+ *
+ * readfd: file descriptor for reading.
+ * writefd: file descriptor for writing.
+ *
+ * returns: number of bytes copied or -1 on error.
+ */
+long long readwrite(int readfd, int writefd) {
+	char buffer[FRAME_MAXLEN];
+	long long total = 0;
+	ssize_t rnum;
+	while ((rnum = read(readfd, buffer, FRAME_MAXLEN)) != 0) {
+		if (rnum == -1 && errno == EINTR) continue;
+		if (rnum == -1 || writedata(writefd, buffer, rnum) == -1) return -1;
+		total += rnum;
+	}
+	return total;
+}
+
+/* Function: sparseread
+ * --------------------
+ * Reads the next piece of a possibly sparse file from its current offset.
+ *	Any hole at the offset is skipped first and its length reported, then
+ *	up to len bytes are read without running into the next hole. Files on
+ *	file systems without SEEK_DATA are read as if they had no holes.
+ *
+ * myfd: file descriptor for the file.
+ * buffer: read buffer.
+ * len: length of the read buffer.
+ * hole: pointer to store the length of the skipped hole in.
+ *
+ * returns: number of bytes read, 0 at the end of the file or -1 on error.
+ */
+ssize_t sparseread(int myfd, char * buffer, size_t len, off_t * hole) {
+
+	off_t pos = lseek(myfd, 0, SEEK_CUR);
+	off_t data = lseek(myfd, pos, SEEK_DATA);
+	*hole = 0;
+
+	/* Nothing but a hole (or nothing at all) is left. */
+	if (data == -1 && errno == ENXIO) {
+		*hole = lseek(myfd, 0, SEEK_END) - pos;
+		return 0;
+	}
+
+	/* No way to find holes, read densely. */
+	if (data == -1 || pos == -1) {
+		if (pos != -1) lseek(myfd, pos, SEEK_SET);
+		return read(myfd, buffer, len);
+	}
+
+	/* Skip to the data and stop at the hole after it. */
+	*hole = data - pos;
+	off_t end = lseek(myfd, data, SEEK_HOLE);
+	lseek(myfd, data, SEEK_SET);
+	if (end > data && (size_t)(end - data) < len) len = end - data;
+	return read(myfd, buffer, len);
+}
+
+/* Function: opennofollow
+ * ----------------------
+ * Opens a path relative to a directory without following a symbolic link
+ *	in any of its components, so a directory swapped for a link while the
+ *	path is in use can't lead outside the directory.
+ *
+ * dirfd: file descriptor for the directory.
+ * path: relative path to open.
+ * flags: flags for open, without O_CREAT.
+ *
+ * returns: file descriptor for the open path or -1 on error.
+ */
+int opennofollow(int dirfd, char * path, int flags) {
+
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_NOFOLLOW | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+
+	int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+	if (fd != -1 || errno != ENOSYS) return fd;
+
+	/* No openat2, walk down one directory at a time instead. */
+	char buffer[PATH_MAX];
+	char * save;
+	if (snprintf(buffer, PATH_MAX, "%s", path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	for (char * comp = strtok_r(buffer, "/", &save); comp != NULL && fd != -1; ) {
+		char * next = strtok_r(NULL, "/", &save);
+		int subfd = -1;
+		if (strcmp(comp, "..") == 0) errno = EXDEV; // Could climb out of dirfd.
+		else subfd = openat(fd, comp, (next == NULL ? flags : O_RDONLY | O_DIRECTORY) | O_NOFOLLOW | O_CLOEXEC);
+		close(fd);
+		fd = subfd;
+		comp = next;
+	}
+	return fd;
+}
@@ -0,0 +1,577 @@
+/* CS 360 (Systems Programming) -- Final Project
+ * 	written by Shawn Hillstrom
+ * ---------------------------------------------
+ * Directory manifests shared by client and server.
+ */
+
+#include "mftp.h"
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+#define HASH_READLEN (256 * 1024) // Bytes read at a time while hashing a file.
+#define HASH_THREADS 16 // Most threads used to hash a manifest.
+
+/* Function: rotl
+ * --------------
+ * Rotates a 64 bit value left.
+ *
+ * value: value to rotate.
+ * bits: number of bits to rotate by.
+ *
+ * returns: rotated value.
+ */
+static uint64_t rotl(uint64_t value, int bits) {
+	return (value << bits) | (value >> (64 - bits));
+}
+
+/* Function: hashround
+ * -------------------
+ * Mixes eight bytes of input into a hash accumulator.
+ *
+ * acc: accumulator.
+ * input: input lane.
+ *
+ * returns: new accumulator.
+ */
+static uint64_t hashround(uint64_t acc, uint64_t input) {
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+/* Function: hashmerge
+ * -------------------
+ * Merges a lane accumulator into the final hash.
+ *
+ * hash: hash so far.
+ * acc: lane accumulator.
+ *
+ * returns: new hash.
+ */
+static uint64_t hashmerge(uint64_t hash, uint64_t acc) {
+	hash ^= hashround(0, acc);
+	return hash * PRIME1 + PRIME4;
+}
+
+/* Function: read64
+ * ----------------
+ * Reads a little endian 64 bit value.
+ *
+ * data: pointer to the value.
+ *
+ * returns: the value.
+ */
+static uint64_t read64(const unsigned char * data) {
+	uint64_t value;
+	memcpy(&value, data, 8);
+	return le64toh(value);
+}
+
+/* Function: hashinit
+ * ------------------
+ * Starts a new XXH64 hash.
+ *
+ * state: hash state.
+ * seed: hash seed.
+ *
+ * returns: void.
+ */
+void hashinit(struct hashstate * state, uint64_t seed) {
+	memset(state, 0, sizeof(struct hashstate));
+	state->seed = seed;
+	state->lanes[0] = seed + PRIME1 + PRIME2;
+	state->lanes[1] = seed + PRIME2;
+	state->lanes[2] = seed;
+	state->lanes[3] = seed - PRIME1;
+}
+
+/* Function: hashupdate
+ * --------------------
+ * Adds data to a hash.
+ *
+ * state: hash state.
+ * data: data to add.
+ * len: length of data.
+ *
+ * returns: void.
+ */
+void hashupdate(struct hashstate * state, const void * data, size_t len) {
+
+	const unsigned char * input = data;
+	state->total += len;
+
+	/* Top up a partial stripe first. */
+	if (state->buflen) {
+		size_t fill = 32 - state->buflen < len ? 32 - state->buflen : len;
+		memcpy(state->buffer + state->buflen, input, fill);
+		state->buflen += fill;
+		input += fill;
+		len -= fill;
+		if (state->buflen < 32) return;
+		for (int i = 0; i < 4; i++) state->lanes[i] = hashround(state->lanes[i], read64(state->buffer + i * 8));
+		state->buflen = 0;
+	}
+
+	/* Then whole stripes straight from the input. */
+	while (len >= 32) {
+		for (int i = 0; i < 4; i++) state->lanes[i] = hashround(state->lanes[i], read64(input + i * 8));
+		input += 32;
+		len -= 32;
+	}
+
+	memcpy(state->buffer, input, len);
+	state->buflen = len;
+}
+
+/* Function: hashdigest
+ * --------------------
+ * Finishes a hash.
+ *
+ * state: hash state.
+ *
+ * returns: the 64 bit hash.
+ */
+uint64_t hashdigest(struct hashstate * state) {
+
+	uint64_t hash;
+	const unsigned char * input = state->buffer;
+	size_t len = state->buflen;
+
+	if (state->total >= 32) {
+		hash = rotl(state->lanes[0], 1) + rotl(state->lanes[1], 7) + rotl(state->lanes[2], 12) + rotl(state->lanes[3], 18);
+		for (int i = 0; i < 4; i++) hash = hashmerge(hash, state->lanes[i]);
+	} else {
+		hash = state->seed + PRIME5;
+	}
+	hash += state->total;
+
+	for (; len >= 8; input += 8, len -= 8) {
+		hash ^= hashround(0, read64(input));
+		hash = rotl(hash, 27) * PRIME1 + PRIME4;
+	}
+	if (len >= 4) {
+		uint32_t value;
+		memcpy(&value, input, 4);
+		hash ^= (uint64_t)le32toh(value) * PRIME1;
+		hash = rotl(hash, 23) * PRIME2 + PRIME3;
+		input += 4;
+		len -= 4;
+	}
+	for (; len > 0; input++, len--) {
+		hash ^= *input * PRIME5;
+		hash = rotl(hash, 11) * PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= PRIME2;
+	hash ^= hash >> 29;
+	hash *= PRIME3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+/* Function: hashbytes
+ * -------------------
+ * Hashes a buffer in one go.
+ *
+ * data: data to hash.
+ * len: length of data.
+ *
+ * returns: the 64 bit hash.
+ */
+uint64_t hashbytes(const void * data, size_t len) {
+	struct hashstate state;
+	hashinit(&state, 0);
+	hashupdate(&state, data, len);
+	return hashdigest(&state);
+}
+
+/* Function: addentry
+ * ------------------
+ * Appends an entry to a manifest.
+ *
+ * manifest: manifest to add to.
+ * path: path of the file relative to the manifest root (copied).
+ * filestat: stat of the file.
+ *
+ * returns: the new entry.
+ */
+static struct manifestentry * addentry(struct manifest * manifest, char * path, struct stat * filestat) {
+
+	if (manifest->count == manifest->size) {
+		manifest->size = manifest->size ? manifest->size * 2 : 256;
+		manifest->entries = realloc(manifest->entries, manifest->size * sizeof(struct manifestentry));
+		if (manifest->entries == NULL) {
+			fprintf(stderr, "realloc (Manifest: addentry): Out of memory\n");
+			exit(1);
+		}
+	}
+
+	struct manifestentry * entry = &manifest->entries[manifest->count++];
+	memset(entry, 0, sizeof(struct manifestentry));
+	entry->path = strdup(path);
+	if (entry->path == NULL) {
+		fprintf(stderr, "strdup (Manifest: addentry): Out of memory\n");
+		exit(1);
+	}
+	if (filestat != NULL) {
+		entry->size = filestat->st_size;
+		entry->mtime = filestat->st_mtim.tv_sec * 1000000000LL + filestat->st_mtim.tv_nsec;
+		entry->dev = filestat->st_dev;
+		entry->ino = filestat->st_ino;
+	}
+	return entry;
+}
+
+/* Function: walkdir
+ * -----------------
+ * Adds every regular file below a directory to a manifest. Symbolic links,
+ *	special files, names containing newlines and the manifest cache are
+ *	skipped.
+ *
+ * dirfd: file descriptor for the directory (closed when done).
+ * prefix: path of the directory relative to the manifest root.
+ * manifest: manifest to add to.
+ *
+ * returns: void.
+ */
+static void walkdir(int dirfd, char * prefix, struct manifest * manifest) {
+
+	DIR * dir = fdopendir(dirfd);
+	struct dirent * entry;
+	char path[PATH_MAX];
+	if (dir == NULL) {
+		close(dirfd);
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+
+		struct stat filestat;
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		if (!*prefix && strcmp(entry->d_name, MANIFEST_CACHE) == 0) continue;
+		if (strchr(entry->d_name, '\n') != NULL) continue;
+		if (fstatat(dirfd, entry->d_name, &filestat, AT_SYMLINK_NOFOLLOW) == -1) continue;
+		if (snprintf(path, PATH_MAX, "%s%s%s", prefix, *prefix ? "/" : "", entry->d_name) >= PATH_MAX) continue;
+
+		if (S_ISDIR(filestat.st_mode)) {
+			int subfd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (subfd != -1) walkdir(subfd, path, manifest);
+		} else if (S_ISREG(filestat.st_mode)) {
+			addentry(manifest, path, &filestat);
+		}
+	}
+
+	closedir(dir);
+}
+
+/* Function: compareentries
+ * ------------------------
+ * qsort/bsearch comparator ordering manifest entries by path.
+ */
+static int compareentries(const void * a, const void * b) {
+	return strcmp(((struct manifestentry *)a)->path, ((struct manifestentry *)b)->path);
+}
+
+/* Function: comparecached
+ * -----------------------
+ * qsort/bsearch comparator ordering cache entries by device and inode.
+ */
+static int comparecached(const void * a, const void * b) {
+	const struct manifestentry * x = a;
+	const struct manifestentry * y = b;
+	if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/* Structure: hashjob
+ * ------------------
+ * Work shared by the threads hashing a manifest.
+ */
+struct hashjob {
+	int rootfd;
+	struct manifest * manifest;
+	atomic_int next;
+};
+
+/* Function: hashworker
+ * --------------------
+ * Hashing thread, takes the next unhashed entry until none are left.
+ *
+ * arg: the hash job.
+ *
+ * returns: NULL.
+ */
+static void * hashworker(void * arg) {
+
+	struct hashjob * job = arg;
+	unsigned char * buffer = malloc(HASH_READLEN);
+	if (buffer == NULL) {
+		fprintf(stderr, "malloc (Manifest: hashworker): Out of memory\n");
+		exit(1);
+	}
+
+	while (1) {
+
+		int index = atomic_fetch_add(&job->next, 1);
+		if (index >= job->manifest->count) break;
+		struct manifestentry * entry = &job->manifest->entries[index];
+		if (entry->hashed) continue;
+
+		int myfd = opennofollow(job->rootfd, entry->path, O_RDONLY);
+		if (myfd == -1) continue;
+
+		struct hashstate state;
+		ssize_t rnum;
+		hashinit(&state, 0);
+		while ((rnum = read(myfd, buffer, HASH_READLEN)) > 0) hashupdate(&state, buffer, rnum);
+		if (rnum == 0) {
+			entry->hash = hashdigest(&state);
+			entry->hashed = 1;
+		}
+		close(myfd);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/* Function: loadcache
+ * -------------------
+ * Reads the manifest cache of a directory.
+ *
+ * rootfd: file descriptor for the directory.
+ * cache: manifest to read the cache into, sorted by device and inode.
+ *
+ * returns: void.
+ */
+static void loadcache(int rootfd, struct manifest * cache) {
+
+	int cachefd = openat(rootfd, MANIFEST_CACHE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	FILE * file = cachefd == -1 ? NULL : fdopen(cachefd, "r");
+	unsigned long long dev, ino, hash;
+	long long size, mtime;
+	if (file == NULL) {
+		if (cachefd != -1) close(cachefd);
+		return;
+	}
+
+	while (fscanf(file, "%llu %llu %lld %lld %llx\n", &dev, &ino, &size, &mtime, &hash) == 5) {
+		struct manifestentry * entry = addentry(cache, "", NULL);
+		entry->dev = dev;
+		entry->ino = ino;
+		entry->size = size;
+		entry->mtime = mtime;
+		entry->hash = hash;
+	}
+	fclose(file);
+
+	qsort(cache->entries, cache->count, sizeof(struct manifestentry), comparecached);
+}
+
+/* Function: savecache
+ * -------------------
+ * Replaces the manifest cache of a directory with a manifest's hashes.
+ *
+ * rootfd: file descriptor for the directory.
+ * manifest: manifest to save.
+ *
+ * returns: void.
+ */
+static void savecache(int rootfd, struct manifest * manifest) {
+
+	char temp[64];
+	snprintf(temp, 64, "%s.%d", MANIFEST_CACHE, (int)getpid());
+	int cachefd = openat(rootfd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	FILE * file = cachefd == -1 ? NULL : fdopen(cachefd, "w");
+	if (file == NULL) {
+		if (cachefd != -1) close(cachefd);
+		return;
+	}
+
+	for (int i = 0; i < manifest->count; i++) {
+		struct manifestentry * entry = &manifest->entries[i];
+		if (!entry->hashed) continue;
+		fprintf(file, "%llu %llu %lld %lld %016llx\n", (unsigned long long)entry->dev, (unsigned long long)entry->ino,
+			entry->size, entry->mtime, (unsigned long long)entry->hash);
+	}
+
+	/* Swap the new cache in only once it is complete. */
+	if (fclose(file) == 0) renameat(rootfd, temp, rootfd, MANIFEST_CACHE);
+	else unlinkat(rootfd, temp, 0);
+}
+
+/* Function: buildmanifest
+ * -----------------------
+ * Builds the manifest of a directory tree: the path, size, modification
+ *	time and content hash of every regular file, sorted by path. Files are
+ *	hashed by a pool of threads. With usecache, hashes of files whose
+ *	device, inode, size and modification time match the directory's cache
+ *	are reused and the cache is rewritten afterwards.
+ *
+ * rootfd: file descriptor for the directory.
+ * manifest: manifest to fill in.
+ * usecache: whether to use the manifest cache.
+ *
+ * returns: number of files hashed (not taken from the cache).
+ */
+int buildmanifest(int rootfd, struct manifest * manifest, int usecache) {
+
+	/* Initialize variables. */
+	struct manifest cache = {0};
+	struct hashjob job = {.rootfd = rootfd, .manifest = manifest};
+	int hashed = 0;
+
+	memset(manifest, 0, sizeof(struct manifest));
+	int dirfd = openat(rootfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd != -1) walkdir(dirfd, "", manifest);
+	qsort(manifest->entries, manifest->count, sizeof(struct manifestentry), compareentries);
+
+	/* Take whatever the cache already knows. */
+	if (usecache) {
+		loadcache(rootfd, &cache);
+		for (int i = 0; i < manifest->count && cache.count; i++) {
+			struct manifestentry * entry = &manifest->entries[i];
+			struct manifestentry * cached = bsearch(entry, cache.entries, cache.count, sizeof(struct manifestentry),
+				comparecached);
+			if (cached != NULL && cached->size == entry->size && cached->mtime == entry->mtime) {
+				entry->hash = cached->hash;
+				entry->hashed = 1;
+			}
+		}
+		freemanifest(&cache);
+	}
+	for (int i = 0; i < manifest->count; i++) hashed += !manifest->entries[i].hashed;
+
+	/* Hash the rest in parallel. */
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > hashed) nthreads = hashed;
+	if (nthreads > HASH_THREADS) nthreads = HASH_THREADS;
+	pthread_t threads[HASH_THREADS];
+	atomic_init(&job.next, 0);
+	for (int i = 0; i < nthreads; i++) {
+		int err = pthread_create(&threads[i], NULL, hashworker, &job);
+		if (err) {
+			fprintf(stderr, "pthread_create (Manifest: buildmanifest): %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+	if (usecache && hashed) savecache(rootfd, manifest);
+	return hashed;
+}
+
+/* Function: writemanifest
+ * -----------------------
+ * Writes a manifest as lines of hash, size, modification time (in
+ *	nanoseconds) and path. Files that could not be read are left out.
+ *
+ * outfd: file descriptor to write to.
+ * manifest: manifest to write.
+ *
+ * returns: 0 on success, -1 if a write failed.
+ */
+int writemanifest(int outfd, struct manifest * manifest) {
+
+	char buffer[PATH_MAX + 64];
+
+	for (int i = 0; i < manifest->count; i++) {
+		struct manifestentry * entry = &manifest->entries[i];
+		if (!entry->hashed) continue;
+		int len = snprintf(buffer, sizeof(buffer), "%016llx %lld %lld %s\n", (unsigned long long)entry->hash,
+			entry->size, entry->mtime, entry->path);
+		for (int index = 0; index < len; ) {
+			ssize_t wnum = write(outfd, buffer + index, len - index);
+			if (wnum <= 0) return -1;
+			index += wnum;
+		}
+	}
+
+	return 0;
+}
+
+/* Function: validpath
+ * --------------------
+ * Checks that a manifest path stays inside the directory it is relative
+ *	to: it must not be empty or absolute, and no component may be empty,
+ *	"." or "..".
+ *
+ * path: path to check.
+ *
+ * returns: 1 if the path is safe, 0 otherwise.
+ */
+int validpath(char * path) {
+	if (*path == '\0' || *path == '/') return 0;
+	for (char * start = path; ; ) {
+		size_t len = strcspn(start, "/");
+		if (len == 0 || (len == 1 && start[0] == '.') || (len == 2 && start[0] == '.' && start[1] == '.')) return 0;
+		if (start[len] == '\0') return 1;
+		start += len + 1;
+	}
+}
+
+/* Function: readmanifest
+ * ----------------------
+ * Reads a manifest written by writemanifest, dropping entries whose path
+ *	could escape the directory (see validpath).
+ *
+ * file: stream to read from.
+ * manifest: manifest to fill in, sorted by path.
+ *
+ * returns: void.
+ */
+void readmanifest(FILE * file, struct manifest * manifest) {
+
+	char line[PATH_MAX + 64];
+	unsigned long long hash;
+	long long size, mtime;
+	int offset;
+
+	memset(manifest, 0, sizeof(struct manifest));
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%llx %lld %lld %n", &hash, &size, &mtime, &offset) != 3 || !validpath(line + offset)) continue;
+		struct manifestentry * entry = addentry(manifest, line + offset, NULL);
+		entry->hash = hash;
+		entry->size = size;
+		entry->mtime = mtime;
+		entry->hashed = 1;
+	}
+
+	qsort(manifest->entries, manifest->count, sizeof(struct manifestentry), compareentries);
+}
+
+/* Function: findentry
+ * -------------------
+ * Looks up a path in a manifest.
+ *
+ * manifest: manifest sorted by path.
+ * path: path to look for.
+ *
+ * returns: the entry or NULL if the path isn't in the manifest.
+ */
+struct manifestentry * findentry(struct manifest * manifest, char * path) {
+	struct manifestentry key = {.path = path};
+	if (!manifest->count) return NULL;
+	return bsearch(&key, manifest->entries, manifest->count, sizeof(struct manifestentry), compareentries);
+}
+
+/* Function: freemanifest
+ * ----------------------
+ * Frees a manifest.
+ *
+ * manifest: manifest to free.
+ *
+ * returns: void.
+ */
+void freemanifest(struct manifest * manifest) {
+	for (int i = 0; i < manifest->count; i++) free(manifest->entries[i].path);
+	free(manifest->entries);
+	memset(manifest, 0, sizeof(struct manifest));
+}
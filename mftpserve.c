@@ -6,6 +6,24 @@
 
 #include "mftp.h"
 
+#define LVL_DEBUG 0
+#define LVL_INFO 1
+#define LVL_WARN 2
+#define LVL_ERROR 3
+
+#define LOG_RECORDS 4096 // Slots in the shared log ring.
+#define LOG_MSGLEN 192
+#define LOG_LINELEN 512 // Longest formatted log line.
+#define LOG_BATCH 65536 // Bytes the log writer formats before writing.
+#define LOG_IDLE_NS 10000000 // How long the log writer sleeps when the ring is empty.
+#define LOG_STALL_US 1000000 // How long the log writer waits for a claimed record before skipping it.
+
+#define FIND_THREADS 16 // Most worker threads a search uses.
+#define FIND_OUTLEN 65536 // Matches a search worker buffers before writing.
+#define FIND_DIRENTLEN 32768 // Buffer for getdents64.
+#define TAIL_BUFLEN 65536 // Bytes a followed file is read in at a time.
+#define DIRCACHE_SIZE 256 // Directories a session keeps resolved.
+
 /* Function: checkerr
  * ------------------
  * Checks a given function return value against it's known error value
@@ -30,10 +48,11 @@ void checkerr(int fret, int eval, char * msg) {
  *
  * port: port number for the socket.
  * backlog: backlog for the passive socket.
+ * tuning: tuning profile for the socket.
  *
  * returns: file descriptor for the new socket.
  */
-int establishsocket(unsigned short port, int backlog) {
+int establishsocket(unsigned short port, int backlog, struct tuning * tuning) {
 
 	/* Create socket. */
 	int socketfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -46,6 +65,9 @@ int establishsocket(unsigned short port, int backlog) {
 	servAddr.sin_port = htons(port);
 	servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+	/* Size the buffers before the connection is accepted. */
+	checkerr(applytuning(socketfd, tuning, TUNE_LISTEN), -1, "setsockopt (Server: establishsocket)");
+
 	/* Bind the socket. */
 	checkerr(bind(socketfd, (struct sockaddr *)&servAddr, (socklen_t)sizeof(servAddr)), -1,
 		"bind (Server: establishsocket");
@@ -117,284 +139,2787 @@ int readhandler(int connectfd, char * buffer, int buflen) {
 	return index;
 }
 
-/* Function: executecmd
+/* Structure: logrecord
  * --------------------
- * Executes a shell command using execlp given a command name and 
- *	an argument.
+ * A fixed-size log record. bytes and micros are -1 when they don't apply.
+ */
+struct logrecord {
+	struct timespec time;
+	pid_t pid;
+	int level;
+	long long bytes;
+	long long micros;
+	char host[64];
+	char event[16];
+	char msg[LOG_MSGLEN];
+};
+
+/* Structure: logring
+ * ------------------
+ * Bounded multi-producer ring of log records shared by every session
+ *	process. A slot's sequence number tells producers when it is free and
+ *	the writer when it has been filled. A slot that stays claimed but
+ *	unfilled for LOG_STALL_US (its producer died) is skipped by the writer.
+ */
+struct logring {
+	atomic_size_t head;
+	size_t tail;
+	atomic_ulong dropped;
+	atomic_int level;
+	struct {
+		atomic_size_t seq;
+		struct logrecord record;
+	} slots[LOG_RECORDS];
+};
+
+struct logring * logring = NULL; // Shared log ring, mapped before any session is forked.
+int logfd = -1; // Destination of the log writer.
+
+char * levelnames[] = {"debug", "info", "warn", "error"};
+
+volatile sig_atomic_t reload = 0; // Set by SIGHUP.
+
+/* Function: microsince
+ * --------------------
+ * Computes the time elapsed since a starting point.
  *
- * name: name of the shell command.
- * arg: argument to pass to the shell command.
+ * start: starting point (CLOCK_MONOTONIC).
  *
- * returns: void.
+ * returns: elapsed time in microseconds.
  */
-void executecmd(char * name, char * arg) {
-	checkerr(execlp(name, name, arg, NULL), -1, "execlp (Server: executecmd)");
+long long microsince(struct timespec * start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
-/* Function: executels
- * -------------------
- * Executes the command ls -l and pipes the output to a data connection.
+/* Function: logevent
+ * ------------------
+ * Queues a structured log record without blocking. If the ring is full the
+ *	record is dropped and counted instead. Signals are held off while the
+ *	record is filled so a session that is told to stop can't leave it
+ *	unfinished.
  *
- * datafd: file descriptor for data connection.
+ * level: log level of the record.
+ * host: hostname of the session (may be NULL).
+ * event: short name of the event.
+ * bytes: number of bytes transferred or -1.
+ * micros: duration of the event in microseconds or -1.
+ * fmt: printf style format for the message.
  *
  * returns: void.
  */
-void executels(int datafd) {
+void logevent(int level, char * host, char * event, long long bytes, long long micros, char * fmt, ...) {
 
-	/* Wait for connection. */
-	int connectfd = acceptconnection(datafd);
+	if (level < atomic_load_explicit(&logring->level, memory_order_relaxed)) return;
 
-	/* Fork... */
-	int pid = fork();
-	checkerr(pid, -1, "fork (Server: executels)");
+	sigset_t blocked, saved;
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_BLOCK, &blocked, &saved);
 
-	/* ...and exec. */
-	if (!pid) {
-		checkerr(dup2(connectfd, STDOUT_FILENO), -1, "dup2 (Server: executels)");
-		close(connectfd);
-		executecmd("ls", "-l");
+	/* Claim a slot. */
+	size_t pos = atomic_load_explicit(&logring->head, memory_order_relaxed);
+	while (1) {
+		size_t seq = atomic_load_explicit(&logring->slots[pos % LOG_RECORDS].seq, memory_order_acquire);
+		long diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&logring->head, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed)) break;
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&logring->dropped, 1, memory_order_relaxed);
+			pthread_sigmask(SIG_SETMASK, &saved, NULL);
+			return;
+		} else {
+			pos = atomic_load_explicit(&logring->head, memory_order_relaxed);
+		}
 	}
 
-	/* Close the connection. */
-	close(connectfd);
+	/* Fill it in and publish it to the writer. */
+	struct logrecord * record = &logring->slots[pos % LOG_RECORDS].record;
+	clock_gettime(CLOCK_REALTIME, &record->time);
+	record->pid = getpid();
+	record->level = level;
+	record->bytes = bytes;
+	record->micros = micros;
+	snprintf(record->host, sizeof(record->host), "%s", host == NULL ? "" : host);
+	snprintf(record->event, sizeof(record->event), "%s", event);
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(record->msg, LOG_MSGLEN, fmt, args);
+	va_end(args);
+
+	/* If the writer gave up waiting on this slot it belongs to someone else now, drop the record. */
+	size_t claimed = pos;
+	if (!atomic_compare_exchange_strong_explicit(&logring->slots[pos % LOG_RECORDS].seq, &claimed, pos + 1,
+		memory_order_release, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&logring->dropped, 1, memory_order_relaxed);
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
 }
 
-/* Function: openfile
- * ------------------
- * Opens a file with given flags.
+/* Function: formatrecord
+ * ----------------------
+ * Formats a log record as a line of key=value pairs.
  *
- * connectfd: file descriptor for current connection (for error messages).
- * filename: name of file.
- * flags: flags for open.
+ * record: record to format.
+ * buffer: output buffer.
+ * buflen: length of output buffer.
  *
- * returns: file descriptor for open file or -1 if the file is invalid.
+ * returns: length of the formatted line.
  */
-int openfile(int connectfd, char * filename, int flags) {
+int formatrecord(struct logrecord * record, char * buffer, int buflen) {
+
+	struct tm tm;
+	char stamp[32];
+	gmtime_r(&record->time.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	int level = record->level < LVL_DEBUG || record->level > LVL_ERROR ? LVL_ERROR : record->level;
+	int len = snprintf(buffer, buflen, "time=%s.%06ldZ level=%s pid=%d", stamp,
+		record->time.tv_nsec / 1000, levelnames[level], (int)record->pid);
+	if (record->host[0] && len < buflen) len += snprintf(buffer + len, buflen - len, " host=%s", record->host);
+	if (len < buflen) len += snprintf(buffer + len, buflen - len, " event=%s", record->event);
+	if (record->bytes >= 0 && len < buflen) len += snprintf(buffer + len, buflen - len, " bytes=%lld", record->bytes);
+	if (record->micros >= 0 && len < buflen) len += snprintf(buffer + len, buflen - len, " dur_us=%lld", record->micros);
+	if (len < buflen) len += snprintf(buffer + len, buflen - len, " msg=\"%s\"\n", record->msg);
+
+	if (len >= buflen) {
+		len = buflen - 1;
+		buffer[len - 1] = '\n';
+	}
+	return len;
+}
 
-	/* Initialize variables. */
-	char clientmsg[256] = {0};
-	struct stat filestat;
-	int myfd = open(filename, flags);
+/* Function: logwriter
+ * -------------------
+ * Background thread draining the log ring. Records are written out in
+ *	batches so a slow log destination only ever stalls this thread.
+ *
+ * arg: unused.
+ *
+ * returns: never.
+ */
+void * logwriter(void * arg) {
+
+	(void)arg;
+	char * batch = malloc(LOG_BATCH);
+	unsigned long reported = 0;
+	unsigned long skipped = 0;
+	size_t stalled = SIZE_MAX; // Slot the writer is waiting on and since when.
+	struct timespec stalledsince;
+	if (batch == NULL) {
+		fprintf(stderr, "malloc (Server: logwriter): Out of memory\n");
+		exit(1);
+	}
 
-	/* Check to see if the file exists and can be opened. */
-	if (myfd == -1) {
-		if (errno == ENOENT) {
-			snprintf(clientmsg, 256, "E%s does not exist\n", filename);
-			msghandler(connectfd, clientmsg);
-			printf("ERROR: %s does not exist\n", filename);
-		} else if (errno == EEXIST) {
-			snprintf(clientmsg, 256, "E%s already exists\n", filename);
-			msghandler(connectfd, clientmsg);
-			printf("ERROR: %s already exists\n", filename);
-		} else {
-			snprintf(clientmsg, 256, "ECannot open %s\n", filename);
-			msghandler(connectfd, clientmsg);
-			printf("ERROR: %s cannot open\n", filename);
+	while (1) {
+
+		int len = 0;
+
+		/* Report records dropped since the last batch. */
+		unsigned long dropped = atomic_load_explicit(&logring->dropped, memory_order_relaxed);
+		if (dropped != reported) {
+			struct logrecord notice = {.pid = getpid(), .level = LVL_WARN, .bytes = -1, .micros = -1, .event = "log"};
+			clock_gettime(CLOCK_REALTIME, &notice.time);
+			snprintf(notice.msg, LOG_MSGLEN, "Dropped %lu records (%lu total)", dropped - reported, dropped);
+			len += formatrecord(&notice, batch, LOG_LINELEN);
+			reported = dropped;
 		}
-		return myfd;
-	} else {
 
-		/* stat the file. */
-		checkerr(fstat(myfd, &filestat), -1, "stat (server: openfile)");
+		/* Format as many records as fit in the batch. */
+		while (len < LOG_BATCH - LOG_LINELEN) {
+			size_t pos = logring->tail;
+			size_t seq = atomic_load_explicit(&logring->slots[pos % LOG_RECORDS].seq, memory_order_acquire);
+			if (seq != pos + 1) {
+
+				/* Wait for the next record, unless it was claimed and never filled for too long. */
+				if (atomic_load_explicit(&logring->head, memory_order_relaxed) == pos) break;
+				if (stalled != pos) {
+					stalled = pos;
+					clock_gettime(CLOCK_MONOTONIC, &stalledsince);
+					break;
+				}
+				if (microsince(&stalledsince) < LOG_STALL_US) break;
+				if (!atomic_compare_exchange_strong_explicit(&logring->slots[pos % LOG_RECORDS].seq, &seq,
+					pos + LOG_RECORDS, memory_order_release, memory_order_acquire)) continue;
+
+				/* Its producer is gone, free the slot and say a record was lost. */
+				struct logrecord notice = {.pid = getpid(), .level = LVL_WARN, .bytes = -1, .micros = -1, .event = "log"};
+				clock_gettime(CLOCK_REALTIME, &notice.time);
+				snprintf(notice.msg, LOG_MSGLEN, "Lost a record its session never finished (%lu total)", ++skipped);
+				len += formatrecord(&notice, batch + len, LOG_LINELEN);
+				logring->tail = pos + 1;
+				continue;
+			}
+			len += formatrecord(&logring->slots[pos % LOG_RECORDS].record, batch + len, LOG_LINELEN);
+			atomic_store_explicit(&logring->slots[pos % LOG_RECORDS].seq, pos + LOG_RECORDS, memory_order_release);
+			logring->tail = pos + 1;
+		}
 
-		/* Check to see if the file is regular. */
-		if (!S_ISREG(filestat.st_mode) || S_ISDIR(filestat.st_mode)) {
-			snprintf(clientmsg, 256, "E%s is not a regular file\n", filename);
-			msghandler(connectfd, clientmsg);
-			printf("ERROR: %s is not a regular file\n", filename);
-			close(myfd);
-			return -1;
+		/* Write the batch out, or wait a little for more records. */
+		if (len > 0) {
+			for (int index = 0; index < len; ) {
+				ssize_t wnum = write(logfd, batch + index, len - index);
+				if (wnum <= 0) break; // Nowhere to put it, lose the batch rather than the server.
+				index += wnum;
+			}
+		} else {
+			struct timespec idle = {0, LOG_IDLE_NS};
+			nanosleep(&idle, NULL);
 		}
 	}
 
-	/* Acknowledge and return successful result. */
-	msghandler(connectfd, "A\n");
-	return myfd;
+	return NULL;
 }
 
-/* Function: readwrite
- * -------------------
- * Reads from one file descriptor and writes to another one character at a
- * 	time.
+/* Function: loginit
+ * -----------------
+ * Maps the shared log ring and starts the log writer. Must be called
+ *	before any session is forked.
  *
- * readfd: file descriptor for reading.
- * writefd: file descriptor for writing.
+ * path: file to append the log to, or NULL for stdout.
+ * level: lowest log level to record.
  *
  * returns: void.
  */
-void readwrite(int readfd, int writefd) {
-	char nextc;
-	while(read(readfd, &nextc, 1)) {
-		write(writefd, &nextc, 1);
+void loginit(char * path, int level) {
+
+	logring = mmap(NULL, sizeof(struct logring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (logring == MAP_FAILED) checkerr(-1, -1, "mmap (Server: loginit)");
+	for (size_t i = 0; i < LOG_RECORDS; i++) atomic_init(&logring->slots[i].seq, i);
+	atomic_init(&logring->head, 0);
+	atomic_init(&logring->dropped, 0);
+	atomic_init(&logring->level, level);
+	logring->tail = 0;
+
+	logfd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP) : dup(STDOUT_FILENO);
+	checkerr(logfd, -1, "open (Server: loginit)");
+
+	pthread_t thread;
+	int err = pthread_create(&thread, NULL, logwriter, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create (Server: loginit): %s\n", strerror(err));
+		exit(1);
 	}
+	pthread_detach(thread);
 }
 
-/* Function: getsocketinfo
- * -----------------------
- * Gets the info associated with a socket file descriptor and returns a structure
- * 	containing said info.
+/* Function: logreopen
+ * -------------------
+ * Switches the log writer to a new destination, or reopens the current
+ *	one after it has been rotated.
  *
- * socketfd: file descriptor for a socket.
+ * path: file to append the log to, or NULL for stdout.
  *
- * returns: structure containing socket info.
+ * returns: void.
  */
-struct sockaddr_in getsocketinfo(int socketfd) {
-	struct sockaddr_in socketAddr;
-	socklen_t socketLen = sizeof(socketAddr);
-	checkerr(getsockname(socketfd, (struct sockaddr *)&socketAddr, &socketLen), -1,
-		"getsockname (Server: getsocketinfo)");
-	return socketAddr;
+void logreopen(char * path) {
+	int newfd = path != NULL ? open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP) : dup(STDOUT_FILENO);
+	if (newfd == -1) {
+		logevent(LVL_ERROR, NULL, "log", -1, -1, "Cannot open %s: %s", path, strerror(errno));
+		return;
+	}
+	dup2(newfd, logfd); // Atomically swaps the writer over.
+	close(newfd);
 }
 
-/* Function: serverhandler
- * -----------------
- * Handles all incoming connections to the server.
+/* Function: loglevel
+ * ------------------
+ * Looks up a log level by name.
  *
- * connectfd: file descriptor for connection.
- * hostname: hostname for connection.
+ * name: name of the level.
  *
- * returns: void.
+ * returns: the log level or -1 if the name is unknown.
  */
-void serverhandler(int connectfd, char * hostname) {
+int loglevel(char * name) {
+	for (int i = LVL_DEBUG; i <= LVL_ERROR; i++) {
+		if (strcmp(name, levelnames[i]) == 0) return i;
+	}
+	return -1;
+}
 
-	int datafd = 0; // File descriptor for data socket.
+/* Structure: cacheddir
+ * --------------------
+ * A directory a session has already resolved. path is relative to the
+ *	session's base directory and NULL while the slot is free.
+ */
+struct cacheddir {
+	char * path;
+	int fd;
+	int wd;
+	unsigned long lastuse;
+};
+
+/* Structure: session
+ * ------------------
+ * File system state of a session. Paths from the client are resolved
+ *	against basefd and never against the process working directory. An
+ *	unconfined session's basefd is its working directory. A confined
+ *	session's basefd is its root, cwd is the working directory relative to
+ *	it and every path is resolved with RESOLVE_BENEATH. dirs caches the
+ *	directories paths run through. inotify watches on them (and on
+ *	basefd) drop an entry as soon as the name it was resolved from changes.
+ */
+struct session {
+	int basefd;
+	int confine;
+	char cwd[PATH_MAX];
+	int notifyfd;
+	int basewd;
+	unsigned long clock;
+	struct cacheddir dirs[DIRCACHE_SIZE];
+};
+
+/* Function: openbeneath
+ * ---------------------
+ * Opens a path relative to a directory, refusing to leave the directory
+ *	when asked to.
+ *
+ * dirfd: file descriptor for the directory.
+ * path: path to open.
+ * flags: flags for open, files are created with S_IRUSR | S_IWUSR.
+ * confine: whether the path must resolve beneath dirfd.
+ *
+ * returns: file descriptor for the open path or -1 on error.
+ */
+int openbeneath(int dirfd, char * path, int flags, int confine) {
 
-	while (1) {
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_CLOEXEC;
+	how.mode = flags & O_CREAT ? S_IRUSR | S_IWUSR : 0;
+	how.resolve = confine ? RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS : 0;
 
-		/* Initialize variables. */
-		char buffer [512] = {0};
-		char clientmsg [256] = {0};
+	int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+	if (fd == -1 && errno == ENOSYS && !confine) fd = openat(dirfd, path, flags | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	return fd;
+}
 
-		/* Read the next command from the connection. */
-		readhandler(connectfd, buffer, 512);
+/* Function: normalizepath
+ * -----------------------
+ * Turns a path from a confined session's client into a path relative to
+ *	the session root. Absolute paths start at the root and .. never leaves
+ *	it.
+ *
+ * cwd: working directory relative to the root.
+ * path: path to normalize.
+ * out: buffer of PATH_MAX bytes for the result ("" for the root itself).
+ *
+ * returns: 0 on success, -1 if the result is too long.
+ */
+int normalizepath(char * cwd, char * path, char * out) {
 
-		/* Handle commands. */
-		if (buffer[0] == 'D') {
+	char buffer[PATH_MAX * 2];
+	char * save;
+	size_t len = 0;
 
-			datafd = establishsocket(0, 1);
-			struct sockaddr_in dataAddr = getsocketinfo(datafd);
-			snprintf(clientmsg, 256, "A%hu\n", htons(dataAddr.sin_port)); // convert address from network byte order to host byte order.
-			msghandler(connectfd, clientmsg);
+	snprintf(buffer, PATH_MAX * 2, "%s/%s", path[0] == '/' ? "" : cwd, path);
 
-		} else if (buffer[0] == 'C') {
+	for (char * comp = strtok_r(buffer, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+		if (strcmp(comp, ".") == 0) continue;
+		if (strcmp(comp, "..") == 0) {
+			while (len > 0 && out[len - 1] != '/') len--;
+			if (len > 0) len--;
+			continue;
+		}
+		size_t complen = strlen(comp);
+		if (len + complen + 2 > PATH_MAX) return -1;
+		if (len > 0) out[len++] = '/';
+		memcpy(out + len, comp, complen);
+		len += complen;
+	}
 
-			/* Get pathname. */
-			char * path = strtok(buffer + 1, "\n");
+	out[len] = '\0';
+	return 0;
+}
 
-			/* Try to change current working directory to pathname, sending appropriate errors if chdir fails. */
-			if (chdir(path) == -1) {
-				snprintf(clientmsg, 256, "EInvalid pathname %s\n", path);
-				msghandler(connectfd, clientmsg);
-				printf("ERROR: Invalid pathname %s\n", path);
-			} else {
-				msghandler(connectfd, "A\n");
-				printf("%s: Changed curent working directory to %s\n", hostname, path);
-			}
+/* Function: dropdirs
+ * ------------------
+ * Drops a cached directory and everything cached beneath it.
+ *
+ * session: session whose cache to change.
+ * path: path of the directory, NULL to empty the cache.
+ *
+ * returns: void.
+ */
+void dropdirs(struct session * session, char * path) {
+	char target[PATH_MAX];
+	size_t len = path == NULL ? 0 : strlen(path);
+	if (path != NULL) snprintf(target, PATH_MAX, "%s", path); // path may belong to an entry being dropped.
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		struct cacheddir * dir = &session->dirs[i];
+		if (dir->path == NULL) continue;
+		if (path != NULL && (strncmp(dir->path, target, len) != 0 || (dir->path[len] && dir->path[len] != '/'))) continue;
+		inotify_rm_watch(session->notifyfd, dir->wd);
+		close(dir->fd);
+		free(dir->path);
+		dir->path = NULL;
+	}
+}
 
-		} else if (buffer[0] == 'L') {
+/* Function: watchfd
+ * -----------------
+ * Adds an inotify watch for an open file descriptor.
+ *
+ * notifyfd: inotify instance.
+ * fd: file descriptor to watch.
+ * mask: events to watch for.
+ *
+ * returns: watch descriptor or -1 on error.
+ */
+int watchfd(int notifyfd, int fd, uint32_t mask) {
+	char proc[64];
+	snprintf(proc, 64, "/proc/self/fd/%d", fd);
+	return inotify_add_watch(notifyfd, proc, mask);
+}
 
-			executels(datafd);
-			close(datafd);
-			msghandler(connectfd, "A\n");
+/* Function: checkdirs
+ * -------------------
+ * Drops cached directories whose names changed since the last lookup:
+ *	directories created, deleted or renamed in a cached directory (or in
+ *	the base directory), and cached directories deleted or moved. The
+ *	whole cache goes if the event queue overflowed.
+ *
+ * session: session whose cache to check.
+ *
+ * returns: void.
+ */
+void checkdirs(struct session * session) {
 
-		} else if (buffer[0] == 'G') {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	ssize_t len;
 
-			/* Get the filename. */
-			char * file = strtok(buffer + 1, "\n");
+	while ((len = read(session->notifyfd, events, sizeof(events))) > 0) {
+		for (char * next = events; next < events + len; ) {
+			struct inotify_event * event = (struct inotify_event *)next;
+			next += sizeof(struct inotify_event) + event->len;
 
-			/* Wait for connection with client. */
-			int dataconnfd = acceptconnection(datafd);
+			/* Events were lost, so any entry may be stale. */
+			if (event->mask & IN_Q_OVERFLOW) {
+				dropdirs(session, NULL);
+				continue;
+			}
 
-			/* Open the file for reading, continue if open fails. */
-			int myfd = openfile(connectfd, file, O_RDONLY);
-			if (myfd == -1) continue;
+			/* Find the directory the event happened in. */
+			char * parent = NULL;
+			if (event->wd == session->basewd) parent = "";
+			for (int i = 0; parent == NULL && i < DIRCACHE_SIZE; i++) {
+				if (session->dirs[i].path != NULL && session->dirs[i].wd == event->wd) parent = session->dirs[i].path;
+			}
+			if (parent == NULL) continue;
+
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+				if (*parent) {
+					snprintf(path, PATH_MAX, "%s", parent);
+					dropdirs(session, path);
+				}
+			} else if ((event->mask & IN_ISDIR) && event->len) {
+				snprintf(path, PATH_MAX, "%s%s%s", parent, *parent ? "/" : "", event->name);
+				dropdirs(session, path);
+			}
+		}
+	}
+}
 
-			/* Read from the file and write to the data connection. */
-			readwrite(myfd, dataconnfd);
+/* Function: finddir
+ * -----------------
+ * Looks up a directory relative to the session's base directory one
+ *	component at a time, using and filling the directory cache. Only real
+ *	directories are cached, so nothing found this way leaves the base.
+ *
+ * session: session to look in.
+ * path: relative path of the directory.
+ *
+ * returns: O_PATH file descriptor owned by the cache or -1 if the path has
+ *	to be resolved in full (absolute paths, ., .., symlinks, no cache).
+ */
+int finddir(struct session * session, char * path) {
 
-			/* Close the data connection, the file, and the data socket. */
-			close(dataconnfd);
-			close(myfd);
-			close(datafd);
+	/* Initialize variables. */
+	char buffer[PATH_MAX];
+	char prefix[PATH_MAX];
+	char * save;
+	size_t len = 0;
+	int parentfd = session->basefd;
+	unsigned long walkstart = session->clock + 1;
+
+	if (session->notifyfd == -1 || path[0] == '/') return -1;
+	checkdirs(session);
+	snprintf(buffer, PATH_MAX, "%s", path);
+
+	for (char * comp = strtok_r(buffer, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+
+		if (strcmp(comp, ".") == 0 || strcmp(comp, "..") == 0) return -1;
+		len += snprintf(prefix + len, PATH_MAX - len, "%s%s", len ? "/" : "", comp);
+		if (len >= PATH_MAX) return -1;
+
+		/* Use the cached directory... */
+		struct cacheddir * found = NULL;
+		struct cacheddir * victim = &session->dirs[0];
+		for (int i = 0; i < DIRCACHE_SIZE && found == NULL; i++) {
+			struct cacheddir * dir = &session->dirs[i];
+			if (dir->path != NULL && strcmp(dir->path, prefix) == 0) found = dir;
+			else if (victim->path != NULL && (dir->path == NULL || dir->lastuse < victim->lastuse)) victim = dir;
+		}
+		if (found != NULL) {
+			found->lastuse = ++session->clock;
+			parentfd = found->fd;
+			continue;
+		}
 
-			/* Print a confirmation server-side. */
-			printf("%s: Sent contents of %s\n", hostname, file);
+		/* ...or look it up and cache it, making room by dropping the least recently used one. */
+		struct stat dirstat;
+		if (fstatat(parentfd, comp, &dirstat, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(dirstat.st_mode)) return -1;
+		if (victim->path != NULL && victim->lastuse >= walkstart) return -1;
+		if (victim->path != NULL) dropdirs(session, victim->path);
+		int fd = openat(parentfd, comp, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1) return -1;
+		int wd = watchfd(session->notifyfd, fd, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		if (wd == -1 || (victim->path = strdup(prefix)) == NULL) {
+			if (wd != -1) inotify_rm_watch(session->notifyfd, wd);
+			close(fd);
+			return -1;
+		}
+		victim->fd = fd;
+		victim->wd = wd;
+		victim->lastuse = ++session->clock;
+		parentfd = fd;
+	}
 
-		} else if (buffer[0] == 'P') {
+	return parentfd;
+}
 
-			/* Get the filename. */
-			char * file = strtok(buffer + 1, "\n");
+/* Function: resolve
+ * -----------------
+ * Opens a path named by a session's client. The directory part comes from
+ *	the directory cache when it can, anything else is resolved in full.
+ *
+ * session: session the path belongs to.
+ * path: path to open.
+ * flags: flags for open.
+ *
+ * returns: file descriptor for the open path or -1 on error.
+ */
+int resolve(struct session * session, char * path, int flags) {
 
-			/* Wait for connection with client. */
-			int dataconnfd = acceptconnection(datafd);
+	/* Initialize variables. */
+	char full[PATH_MAX];
+
+	/* Make the path relative to the root of a confined session. */
+	if (session->confine && normalizepath(session->cwd, path, full) == -1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	} else if (!session->confine) {
+		snprintf(full, PATH_MAX, "%s", path);
+	}
+	size_t len = strlen(full);
+	while (len > 1 && full[len - 1] == '/') full[--len] = '\0';
+	if (!len) snprintf(full, PATH_MAX, ".");
+
+	/* Open the last component from its cached directory, confinement allowing. */
+	char * slash = strrchr(full, '/');
+	if (slash != NULL && slash != full) {
+		*slash = '\0';
+		int dirfd = finddir(session, full);
+		*slash = '/';
+		if (dirfd != -1) {
+			int fd = openbeneath(dirfd, slash + 1, flags, session->confine);
+			if (fd != -1 || errno != EXDEV) return fd;
+		}
+	}
 
-			/* Open the file for writing, creating if it doesn't exit, failing otherwise. */
-			int myfd = openfile(connectfd, file, O_WRONLY | O_CREAT | O_EXCL);
-			if (myfd == -1) continue;
+	return openbeneath(session->basefd, full, flags, session->confine);
+}
 
-			/* Read from the data connection and write to the file. */
-			readwrite(dataconnfd, myfd);
+/* Function: sessioninit
+ * ---------------------
+ * Sets up the file system state of a new session.
+ *
+ * session: session to set up.
+ * root: directory to confine the session to, NULL or "" to start in the
+ *	process working directory unconfined.
+ *
+ * returns: 0 on success, -1 if the starting directory can't be opened.
+ */
+int sessioninit(struct session * session, char * root) {
 
-			/* Close the data connection, set permissions on the file, close the file, and close the data socket. */
-			close(dataconnfd);
-			chmod(file, S_IRUSR | S_IWUSR);
-			close(myfd);
-			close(datafd);
+	memset(session, 0, sizeof(struct session));
+	session->confine = root != NULL && root[0];
+	session->basefd = open(session->confine ? root : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (session->basefd == -1) return -1;
 
-			/* Print a confirmation server-side. */
-			printf("%s: Received contents of %s\n", hostname, file);
+	/* Without inotify the cache can't be kept correct, so there is none. */
+	session->notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	session->basewd = session->notifyfd == -1 ? -1 :
+		watchfd(session->notifyfd, session->basefd, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	return 0;
+}
 
-		} else if (buffer[0] == 'Q') {
+/* Function: fdpath
+ * -----------------
+ * Gets the path of an open file descriptor.
+ *
+ * fd: file descriptor to look at.
+ * buffer: buffer for the path.
+ * buflen: length of buffer.
+ *
+ * returns: 0 on success, -1 if the path can't be read or doesn't fit.
+ */
+int fdpath(int fd, char * buffer, int buflen) {
 
-			msghandler(connectfd, "A\n");
-			printf("%s: Closing connection\n", hostname);
-			break;
+	char proc[64];
+	snprintf(proc, 64, "/proc/self/fd/%d", fd);
 
-		} else {
+	/* readlink truncates silently, a path that fills the buffer may have been cut short. */
+	ssize_t len = readlink(proc, buffer, buflen);
+	if (len == -1) return -1;
+	if (len >= buflen - 1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	buffer[len] = '\0';
+	return 0;
+}
 
-			snprintf(clientmsg, 256, "EInvalid input %s\n", buffer);
-			msghandler(connectfd, clientmsg);
-			printf("ERROR: Invalid input %s\n", buffer);
+/* Function: changedir
+ * -------------------
+ * Changes a session's working directory.
+ *
+ * session: session to change.
+ * path: new working directory.
+ *
+ * returns: 0 on success, -1 if the path is not a directory the session
+ *	can reach or its path is too long.
+ */
+int changedir(struct session * session, char * path) {
+
+	char cwd[PATH_MAX];
+	int dirfd = resolve(session, path, O_PATH | O_DIRECTORY);
+	if (dirfd == -1) return -1;
+
+	/* A confined session keeps its root and only remembers where it is... */
+	if (session->confine) {
+		int result = normalizepath(session->cwd, path, cwd);
+		if (result == 0) snprintf(session->cwd, PATH_MAX, "%s", cwd);
+		else errno = ENAMETOOLONG;
+		close(dirfd);
+		return result;
+	}
 
-		}
+	/* ...an unconfined one moves its base, the cache was relative to the old one. Refuse a directory
+	 *	whose path can't be reported back. */
+	if (fdpath(dirfd, cwd, PATH_MAX) == -1) {
+		close(dirfd);
+		return -1;
 	}
+	dropdirs(session, NULL);
+	close(session->basefd);
+	session->basefd = dirfd;
+	if (session->notifyfd != -1) {
+		inotify_rm_watch(session->notifyfd, session->basewd);
+		session->basewd = watchfd(session->notifyfd, dirfd,
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	}
+	return 0;
 }
 
-/* Main Function */
-int main() {
-
-	/* Establish passive socket. */
-	int port = PORT_NUM;
-	int listenfd = establishsocket(port, 4);
+/* Function: sessioncwd
+ * --------------------
+ * Gets a session's working directory as the client sees it. A confined
+ *	session's root is /.
+ *
+ * session: session to look at.
+ * buffer: buffer for the path.
+ * buflen: length of buffer.
+ *
+ * returns: 0 on success, -1 if the path can't be found or doesn't fit.
+ */
+int sessioncwd(struct session * session, char * buffer, int buflen) {
 
-	while (1) {
+	if (session->confine) {
+		if (snprintf(buffer, buflen, "/%s", session->cwd) < buflen) return 0;
+		errno = ENAMETOOLONG;
+		return -1;
+	}
 
-		/* Wait for connection. */
-		int connectfd = acceptconnection(listenfd);
+	return fdpath(session->basefd, buffer, buflen);
+}
 
-		/* Get rid of zombies. */
-		while (waitpid(-1, NULL, WNOHANG) > 0);
-
-		/* Fork... */
-		pid_t pid = fork();
-		checkerr(pid, -1, "fork (Server: main)");
-
-		/* ...and handle the connection in the child. */
-		if (!pid) {
-			struct sockaddr_in clientAddr = getsocketinfo(connectfd);
-			struct hostent * hostEntry;
-			if((hostEntry = gethostbyaddr(&(clientAddr.sin_addr), sizeof(struct in_addr), AF_INET)) == NULL) {
-				herror("gethostbyaddr (Server: main)");
-				exit(1);
-			}
-			printf("Connection received: %s\n", hostEntry->h_name);
-			serverhandler(connectfd, hostEntry->h_name);
-			close(connectfd); // Close the connection in the child.
-			exit(0);
-		}
+/* Function: sessionforget
+ * ------------------------
+ * Drops a forked child's copy of a session's directory cache. The inotify
+ *	instance is shared with the parent, so the watches are left alone and
+ *	the child resolves every path in full instead of reading the parent's
+ *	events.
+ *
+ * session: child's copy of the session.
+ *
+ * returns: void.
+ */
+void sessionforget(struct session * session) {
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		if (session->dirs[i].path == NULL) continue;
+		close(session->dirs[i].fd);
+		free(session->dirs[i].path);
+		session->dirs[i].path = NULL;
+	}
+	if (session->notifyfd != -1) close(session->notifyfd);
+	session->notifyfd = -1;
+}
 
-		/* Close the connection in the parent. */
+/* Function: enterdir
+ * ------------------
+ * Makes a session's working directory the process working directory, for
+ *	forked children that run commands on the session's behalf. The child's
+ *	copy of the directory cache is dropped first (see sessionforget).
+ *
+ * session: child's copy of the session.
+ *
+ * returns: void.
+ */
+void enterdir(struct session * session) {
+	sessionforget(session);
+	int dirfd = resolve(session, ".", O_PATH | O_DIRECTORY);
+	checkerr(dirfd, -1, "open (Server: enterdir)");
+	checkerr(fchdir(dirfd), -1, "fchdir (Server: enterdir)");
+	close(dirfd);
+}
+
+/* Function: sessionclose
+ * ----------------------
+ * Releases the file system state of a session.
+ *
+ * session: session to release.
+ *
+ * returns: void.
+ */
+void sessionclose(struct session * session) {
+	dropdirs(session, NULL);
+	if (session->notifyfd != -1) close(session->notifyfd);
+	close(session->basefd);
+}
+
+/* Function: splitpath
+ * -------------------
+ * Splits a path into the directory it is in and its last component.
+ *
+ * path: path to split.
+ * dir: buffer of PATH_MAX bytes for the directory.
+ *
+ * returns: pointer to the last component within path.
+ */
+char * splitpath(char * path, char * dir) {
+	char * slash = strrchr(path, '/');
+	if (slash == NULL) snprintf(dir, PATH_MAX, ".");
+	else if (slash == path) snprintf(dir, PATH_MAX, "/");
+	else snprintf(dir, PATH_MAX, "%.*s", (int)(slash - path), path);
+	return slash == NULL ? path : slash + 1;
+}
+
+/* Function: removefile
+ * --------------------
+ * Removes a file a session created, as long as the path still names the
+ *	same file.
+ *
+ * session: session the path belongs to.
+ * path: path of the file.
+ * myfd: file descriptor for the file.
+ *
+ * returns: 0 on success, -1 on error.
+ */
+int removefile(struct session * session, char * path, int myfd) {
+
+	/* Initialize variables. */
+	char dir[PATH_MAX];
+	struct stat filestat, pathstat;
+	char * base = splitpath(path, dir);
+	int result = -1;
+
+	int dirfd = resolve(session, dir, O_PATH | O_DIRECTORY);
+	if (dirfd == -1) return -1;
+	if (fstat(myfd, &filestat) == 0 && fstatat(dirfd, base, &pathstat, AT_SYMLINK_NOFOLLOW) == 0 &&
+		filestat.st_dev == pathstat.st_dev && filestat.st_ino == pathstat.st_ino) {
+		result = unlinkat(dirfd, base, 0);
+	}
+	close(dirfd);
+	return result;
+}
+
+/* Function: executecmd
+ * --------------------
+ * Executes a shell command using execlp given a command name and 
+ *	an argument.
+ *
+ * name: name of the shell command.
+ * arg: argument to pass to the shell command.
+ *
+ * returns: void.
+ */
+void executecmd(char * name, char * arg) {
+	checkerr(execlp(name, name, arg, NULL), -1, "execlp (Server: executecmd)");
+}
+
+/* Function: executels
+ * -------------------
+ * Executes the command ls -l and pipes the output to a data connection.
+ *
+ * datafd: file descriptor for data connection.
+ * tuning: tuning profile for the data connection.
+ * session: session whose working directory to list.
+ *
+ * returns: void.
+ */
+void executels(int datafd, struct tuning * tuning, struct session * session) {
+
+	/* Wait for connection. */
+	int connectfd = acceptconnection(datafd);
+	checkerr(applytuning(connectfd, tuning, TUNE_DATA), -1, "setsockopt (Server: executels)");
+
+	/* Fork... */
+	int pid = fork();
+	checkerr(pid, -1, "fork (Server: executels)");
+
+	/* ...and exec. */
+	if (!pid) {
+		checkerr(dup2(connectfd, STDOUT_FILENO), -1, "dup2 (Server: executels)");
 		close(connectfd);
+		enterdir(session);
+		executecmd("ls", "-l");
+	}
+
+	/* Close the connection. */
+	close(connectfd);
+}
+
+/* Function: checkfile
+ * -------------------
+ * Opens a file with given flags and makes sure it is a regular file.
+ *
+ * session: session the filename belongs to.
+ * filename: name of file.
+ * flags: flags for open.
+ * errmsg: buffer for an error message describing why the open failed.
+ * errlen: length of errmsg.
+ *
+ * returns: file descriptor for open file or -1 if the file is invalid.
+ */
+int checkfile(struct session * session, char * filename, int flags, char * errmsg, int errlen) {
+
+	/* Initialize variables. */
+	struct stat filestat;
+	int myfd = resolve(session, filename, flags);
+
+	/* Check to see if the file exists and can be opened. */
+	if (myfd == -1) {
+		if (errno == ENOENT) snprintf(errmsg, errlen, "%s does not exist", filename);
+		else if (errno == EEXIST) snprintf(errmsg, errlen, "%s already exists", filename);
+		else if (errno == EXDEV) snprintf(errmsg, errlen, "%s is outside the server root", filename);
+		else snprintf(errmsg, errlen, "Cannot open %s", filename);
+		return myfd;
+	}
+
+	/* stat the file. */
+	checkerr(fstat(myfd, &filestat), -1, "stat (server: checkfile)");
+
+	/* Check to see if the file is regular. */
+	if (!S_ISREG(filestat.st_mode) || S_ISDIR(filestat.st_mode)) {
+		snprintf(errmsg, errlen, "%s is not a regular file", filename);
+		close(myfd);
+		return -1;
+	}
+
+	return myfd;
+}
+
+/* Function: openfile
+ * ------------------
+ * Opens a file with given flags.
+ *
+ * connectfd: file descriptor for current connection (for error messages).
+ * hostname: hostname for connection (for the log).
+ * session: session the filename belongs to.
+ * filename: name of file.
+ * flags: flags for open.
+ *
+ * returns: file descriptor for open file or -1 if the file is invalid.
+ */
+int openfile(int connectfd, char * hostname, struct session * session, char * filename, int flags) {
+
+	/* Initialize variables. */
+	char errmsg[240] = {0};
+	char clientmsg[256] = {0};
+	int myfd = checkfile(session, filename, flags, errmsg, 240);
+
+	/* Report the error to the client... */
+	if (myfd == -1) {
+		snprintf(clientmsg, 256, "E%s\n", errmsg);
+		msghandler(connectfd, clientmsg);
+		logevent(LVL_WARN, hostname, "open", -1, -1, "%s", errmsg);
+		return myfd;
+	}
+
+	/* ...or acknowledge and return successful result. */
+	msghandler(connectfd, "A\n");
+	return myfd;
+}
+
+/* Structure: findquery
+ * --------------------
+ * Parameters of a find request. Limits and filters are -1 when unset,
+ *	newer and older are ages in seconds.
+ */
+struct findquery {
+	int maxdepth;
+	long long limit;
+	long long minsize;
+	long long maxsize;
+	long long newer;
+	long long older;
+	char glob[256];
+	char path[PATH_MAX];
+};
+
+/* Structure: findtask
+ * -------------------
+ * A directory waiting to be searched, relative to the search root.
+ */
+struct findtask {
+	char * path;
+	int depth;
+};
+
+/* Structure: findqueue
+ * --------------------
+ * A worker's double ended task queue. The owner pushes and pops at the
+ *	tail, idle workers steal from the head.
+ */
+struct findqueue {
+	pthread_mutex_t lock;
+	struct findtask * tasks;
+	int head;
+	int tail;
+	int size;
+};
+
+/* Structure: finder
+ * -----------------
+ * State shared by the workers of one search.
+ */
+struct finder {
+	struct findquery * query;
+	int rootfd;
+	int outfd;
+	char * separator;
+	time_t now;
+	int nworkers;
+	struct findqueue * queues;
+	atomic_long pending;
+	atomic_long pushes;
+	atomic_llong matches;
+	atomic_int stop;
+	pthread_mutex_t outlock;
+	pthread_mutex_t idlelock;
+	pthread_cond_t idle;
+};
+
+/* Structure: findworker
+ * ---------------------
+ * A worker thread and its output buffer.
+ */
+struct findworker {
+	struct finder * finder;
+	int id;
+	int outlen;
+	char out[FIND_OUTLEN];
+};
+
+/* Structure: linuxdirent
+ * ----------------------
+ * Directory entry as returned by getdents64.
+ */
+struct linuxdirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* Function: parsefind
+ * -------------------
+ * Parses the arguments of a find request:
+ *	<maxdepth> <limit> <minsize> <maxsize> <newer> <older> <glob> <path>
+ *
+ * args: request arguments.
+ * query: structure to fill in.
+ *
+ * returns: 0 on success, -1 if the arguments are malformed.
+ */
+int parsefind(char * args, struct findquery * query) {
+	int offset = 0;
+	if (sscanf(args, "%d %lld %lld %lld %lld %lld %255s %n", &query->maxdepth, &query->limit, &query->minsize,
+		&query->maxsize, &query->newer, &query->older, query->glob, &offset) != 7 || !args[offset]) return -1;
+	snprintf(query->path, PATH_MAX, "%s", args + offset);
+	query->path[strcspn(query->path, "\n")] = '\0';
+	return 0;
+}
+
+/* Function: pushtask
+ * ------------------
+ * Adds a directory to the tail of a worker's queue.
+ *
+ * finder: search state.
+ * id: worker whose queue to add to.
+ * path: path of the directory relative to the search root (taken over).
+ * depth: depth of the directory.
+ *
+ * returns: void.
+ */
+void pushtask(struct finder * finder, int id, char * path, int depth) {
+
+	struct findqueue * queue = &finder->queues[id];
+	atomic_fetch_add(&finder->pending, 1);
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail == queue->size) {
+
+		/* Out of room, reclaim the stolen head or grow. */
+		int used = queue->tail - queue->head;
+		if (queue->head > 0) memmove(queue->tasks, queue->tasks + queue->head, used * sizeof(struct findtask));
+		queue->head = 0;
+		queue->tail = used;
+		if (used * 2 >= queue->size) {
+			queue->size = queue->size ? queue->size * 2 : 64;
+			queue->tasks = realloc(queue->tasks, queue->size * sizeof(struct findtask));
+			if (queue->tasks == NULL) {
+				fprintf(stderr, "realloc (Server: pushtask): Out of memory\n");
+				exit(1);
+			}
+		}
+	}
+	queue->tasks[queue->tail].path = path;
+	queue->tasks[queue->tail++].depth = depth;
+	pthread_mutex_unlock(&queue->lock);
+
+	/* Wake a worker that ran out of tasks. */
+	atomic_fetch_add(&finder->pushes, 1);
+	pthread_mutex_lock(&finder->idlelock);
+	pthread_cond_signal(&finder->idle);
+	pthread_mutex_unlock(&finder->idlelock);
+}
+
+/* Function: taketask
+ * ------------------
+ * Takes the next task for a worker: the newest task in its own queue, or
+ *	failing that the oldest task of another worker.
+ *
+ * finder: search state.
+ * id: worker taking a task.
+ * task: structure to store the task in.
+ *
+ * returns: 1 if a task was taken, 0 otherwise.
+ */
+int taketask(struct finder * finder, int id, struct findtask * task) {
+
+	for (int i = 0; i < finder->nworkers; i++) {
+		struct findqueue * queue = &finder->queues[(id + i) % finder->nworkers];
+		int found = 0;
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail) {
+			*task = i == 0 ? queue->tasks[--queue->tail] : queue->tasks[queue->head++];
+			found = 1;
+		}
+		pthread_mutex_unlock(&queue->lock);
+		if (found) return 1;
+	}
+
+	return 0;
+}
+
+/* Function: stopsearch
+ * --------------------
+ * Stops a search and wakes the idle workers so they can exit.
+ *
+ * finder: search state.
+ *
+ * returns: void.
+ */
+void stopsearch(struct finder * finder) {
+	atomic_store(&finder->stop, 1);
+	pthread_mutex_lock(&finder->idlelock);
+	pthread_cond_broadcast(&finder->idle);
+	pthread_mutex_unlock(&finder->idlelock);
+}
+
+/* Function: flushmatches
+ * ----------------------
+ * Writes a worker's buffered matches to the output.
+ *
+ * worker: worker to flush.
+ *
+ * returns: void.
+ */
+void flushmatches(struct findworker * worker) {
+
+	struct finder * finder = worker->finder;
+	if (!worker->outlen) return;
+
+	pthread_mutex_lock(&finder->outlock);
+	for (int index = 0; index < worker->outlen; ) {
+		ssize_t wnum = write(finder->outfd, worker->out + index, worker->outlen - index);
+		if (wnum <= 0) {
+			stopsearch(finder); // Nobody is listening anymore.
+			break;
+		}
+		index += wnum;
+	}
+	pthread_mutex_unlock(&finder->outlock);
+	worker->outlen = 0;
+}
+
+/* Function: matchentry
+ * --------------------
+ * Checks a directory entry against the filters of a search and buffers it
+ *	as a match. Only entries whose name matches are stat'ed.
+ *
+ * worker: worker searching the directory.
+ * dirfd: file descriptor for the directory.
+ * dirpath: path of the directory relative to the search root.
+ * name: name of the entry.
+ *
+ * returns: void.
+ */
+void matchentry(struct findworker * worker, int dirfd, char * dirpath, char * name) {
+
+	struct finder * finder = worker->finder;
+	struct findquery * query = finder->query;
+	struct stat filestat;
+	struct tm tm;
+	char stamp[32];
+
+	if (fnmatch(query->glob, name, 0) != 0) return;
+	if (fstatat(dirfd, name, &filestat, AT_SYMLINK_NOFOLLOW) == -1) return;
+
+	long long age = finder->now - filestat.st_mtime;
+	if (query->minsize >= 0 && filestat.st_size < query->minsize) return;
+	if (query->maxsize >= 0 && filestat.st_size > query->maxsize) return;
+	if (query->newer >= 0 && age > query->newer) return;
+	if (query->older >= 0 && age < query->older) return;
+
+	/* Respect the result limit. */
+	if (atomic_fetch_add(&finder->matches, 1) >= query->limit && query->limit >= 0) {
+		stopsearch(finder);
+		return;
+	}
+
+	if (worker->outlen > FIND_OUTLEN - PATH_MAX - 64) flushmatches(worker);
+	localtime_r(&filestat.st_mtime, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm);
+	worker->outlen += snprintf(worker->out + worker->outlen, FIND_OUTLEN - worker->outlen, "%12lld %s %s%s%s%s%s\n",
+		(long long)filestat.st_size, stamp, query->path, finder->separator, dirpath, *dirpath ? "/" : "", name);
+}
+
+/* Function: searchdir
+ * -------------------
+ * Searches one directory, matching its entries and queueing its
+ *	subdirectories.
+ *
+ * worker: worker searching the directory.
+ * task: directory to search.
+ *
+ * returns: void.
+ */
+void searchdir(struct findworker * worker, struct findtask * task) {
+
+	/* Initialize variables. */
+	struct finder * finder = worker->finder;
+	struct findquery * query = finder->query;
+	char buffer[FIND_DIRENTLEN];
+	int dirfd = opennofollow(finder->rootfd, *task->path ? task->path : ".", O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1) return;
+
+	while (!atomic_load(&finder->stop)) {
+
+		long rnum = syscall(SYS_getdents64, dirfd, buffer, FIND_DIRENTLEN);
+		if (rnum <= 0) break;
+
+		for (long offset = 0; offset < rnum; ) {
+
+			struct linuxdirent * entry = (struct linuxdirent *)(buffer + offset);
+			offset += entry->d_reclen;
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+			/* Queue subdirectories that are within the depth limit. */
+			int isdir = entry->d_type == DT_DIR;
+			if (entry->d_type == DT_UNKNOWN) {
+				struct stat filestat;
+				isdir = fstatat(dirfd, entry->d_name, &filestat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(filestat.st_mode);
+			}
+			if (isdir && (query->maxdepth < 0 || task->depth + 1 < query->maxdepth)) {
+				char * path = malloc(strlen(task->path) + strlen(entry->d_name) + 2);
+				if (path == NULL) {
+					fprintf(stderr, "malloc (Server: searchdir): Out of memory\n");
+					exit(1);
+				}
+				sprintf(path, "%s%s%s", task->path, *task->path ? "/" : "", entry->d_name);
+				pushtask(finder, worker->id, path, task->depth + 1);
+			}
+
+			matchentry(worker, dirfd, task->path, entry->d_name);
+		}
+	}
+
+	close(dirfd);
+
+	/* Stream what this directory turned up. */
+	flushmatches(worker);
+}
+
+/* Function: findworker
+ * --------------------
+ * Worker thread of a search. Runs until every queued directory has been
+ *	searched or the search is stopped, sleeping while it has nothing to
+ *	take but others are still searching and may queue more.
+ *
+ * arg: the worker.
+ *
+ * returns: NULL.
+ */
+void * findworker(void * arg) {
+
+	struct findworker * worker = arg;
+	struct finder * finder = worker->finder;
+	struct findtask task;
+
+	while (!atomic_load(&finder->stop)) {
+
+		/* Note the pushes seen so far, so one that lands after taketask fails isn't slept through. */
+		long pushes = atomic_load(&finder->pushes);
+		if (taketask(finder, worker->id, &task)) {
+			searchdir(worker, &task);
+			free(task.path);
+			if (atomic_fetch_sub(&finder->pending, 1) == 1) {
+				pthread_mutex_lock(&finder->idlelock);
+				pthread_cond_broadcast(&finder->idle); // That was the last one, let everyone go.
+				pthread_mutex_unlock(&finder->idlelock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&finder->idlelock);
+		while (!atomic_load(&finder->stop) && atomic_load(&finder->pending) > 0 &&
+			atomic_load(&finder->pushes) == pushes) {
+			pthread_cond_wait(&finder->idle, &finder->idlelock);
+		}
+		int done = atomic_load(&finder->pending) == 0;
+		pthread_mutex_unlock(&finder->idlelock);
+		if (done) break;
+	}
+
+	return NULL;
+}
+
+/* Function: findfiles
+ * -------------------
+ * Searches a directory tree with a pool of worker threads, writing each
+ *	match to a file descriptor as a line of size, modification time and
+ *	path as soon as its directory has been searched.
+ *
+ * rootfd: file descriptor for the directory to search.
+ * query: search parameters.
+ * outfd: file descriptor to write matches to.
+ *
+ * returns: number of matches.
+ */
+long long findfiles(int rootfd, struct findquery * query, int outfd) {
+
+	/* Initialize variables. */
+	struct finder finder;
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1) nworkers = 1;
+	if (nworkers > FIND_THREADS) nworkers = FIND_THREADS;
+
+	memset(&finder, 0, sizeof(finder));
+	finder.query = query;
+	finder.rootfd = rootfd;
+	finder.outfd = outfd;
+	finder.separator = query->path[strlen(query->path) - 1] == '/' ? "" : "/";
+	finder.now = time(NULL);
+	finder.nworkers = nworkers;
+	finder.queues = calloc(nworkers, sizeof(struct findqueue));
+	struct findworker * workers = calloc(nworkers, sizeof(struct findworker));
+	pthread_t * threads = calloc(nworkers, sizeof(pthread_t));
+	char * rootpath = strdup("");
+	if (finder.queues == NULL || workers == NULL || threads == NULL || rootpath == NULL) {
+		fprintf(stderr, "calloc (Server: findfiles): Out of memory\n");
+		exit(1);
+	}
+	atomic_init(&finder.pending, 0);
+	atomic_init(&finder.pushes, 0);
+	atomic_init(&finder.matches, 0);
+	atomic_init(&finder.stop, 0);
+	pthread_mutex_init(&finder.outlock, NULL);
+	pthread_mutex_init(&finder.idlelock, NULL);
+	pthread_cond_init(&finder.idle, NULL);
+	for (int i = 0; i < nworkers; i++) pthread_mutex_init(&finder.queues[i].lock, NULL);
+
+	/* Seed the first queue with the root and start the workers. */
+	pushtask(&finder, 0, rootpath, 0);
+	for (int i = 0; i < nworkers; i++) {
+		workers[i].finder = &finder;
+		workers[i].id = i;
+		int err = pthread_create(&threads[i], NULL, findworker, &workers[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create (Server: findfiles): %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (int i = 0; i < nworkers; i++) pthread_join(threads[i], NULL);
+
+	/* Free anything left behind by a stopped search. */
+	long long matches = atomic_load(&finder.matches);
+	for (int i = 0; i < nworkers; i++) {
+		for (int j = finder.queues[i].head; j < finder.queues[i].tail; j++) free(finder.queues[i].tasks[j].path);
+		free(finder.queues[i].tasks);
+		pthread_mutex_destroy(&finder.queues[i].lock);
+	}
+	pthread_mutex_destroy(&finder.outlock);
+	pthread_mutex_destroy(&finder.idlelock);
+	pthread_cond_destroy(&finder.idle);
+	free(finder.queues);
+	free(workers);
+	free(threads);
+
+	return query->limit >= 0 && matches > query->limit ? query->limit : matches;
+}
+
+/* Function: getsocketinfo
+ * -----------------------
+ * Gets the info associated with a socket file descriptor and returns a structure
+ * 	containing said info.
+ *
+ * socketfd: file descriptor for a socket.
+ *
+ * returns: structure containing socket info.
+ */
+struct sockaddr_in getsocketinfo(int socketfd) {
+	struct sockaddr_in socketAddr;
+	socklen_t socketLen = sizeof(socketAddr);
+	checkerr(getsockname(socketfd, (struct sockaddr *)&socketAddr, &socketLen), -1,
+		"getsockname (Server: getsocketinfo)");
+	return socketAddr;
+}
+
+/* Function: forkstream
+ * --------------------
+ * Forks a child whose output becomes an outgoing stream.
+ *
+ * readfd: pointer to store the parent's end of the stream in.
+ * writefd: pointer to store the child's end of the stream in.
+ *
+ * returns: process id of the child in the parent, 0 in the child.
+ */
+pid_t forkstream(int * readfd, int * writefd) {
+
+	int pipefd[2];
+	checkerr(pipe(pipefd), -1, "pipe (Server: forkstream)");
+
+	pid_t pid = fork();
+	checkerr(pid, -1, "fork (Server: forkstream)");
+
+	if (!pid) {
+		close(pipefd[0]); // Close read end.
+		*writefd = pipefd[1];
+	} else {
+		close(pipefd[1]); // Close write end.
+		*readfd = pipefd[0];
+	}
+
+	return pid;
+}
+
+/* Function: sendmanifest
+ * ----------------------
+ * Builds the manifest of a directory and writes it out.
+ *
+ * rootfd: file descriptor for the directory.
+ * usecache: whether to use the directory's manifest cache.
+ * outfd: file descriptor to write the manifest to.
+ * hostname: hostname for connection (for the log).
+ * path: path of the directory (for the log).
+ *
+ * returns: void.
+ */
+void sendmanifest(int rootfd, int usecache, int outfd, char * hostname, char * path) {
+
+	struct manifest manifest;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int hashed = buildmanifest(rootfd, &manifest, usecache);
+	logevent(LVL_DEBUG, hostname, "mirror", -1, microsince(&start), "Built manifest of %s (%d files, %d hashed)",
+		path, manifest.count, hashed);
+	writemanifest(outfd, &manifest);
+	freemanifest(&manifest);
+}
+
+/* Function: parsetail
+ * -------------------
+ * Parses the arguments of a tail request: <count> <l|c> <path>
+ *
+ * args: request arguments.
+ * count: pointer to store the number of lines or bytes to start with in.
+ * unit: pointer to store 'l' (lines) or 'c' (bytes) in.
+ * path: buffer of PATH_MAX bytes for the path of the file.
+ *
+ * returns: 0 on success, -1 if the arguments are malformed.
+ */
+int parsetail(char * args, long long * count, char * unit, char * path) {
+	int offset = 0;
+	if (sscanf(args, "%lld %c %n", count, unit, &offset) != 2 || !args[offset] || *count < 0 ||
+		(*unit != 'l' && *unit != 'c')) return -1;
+	snprintf(path, PATH_MAX, "%s", args + offset);
+	path[strcspn(path, "\n")] = '\0';
+	return 0;
+}
+
+/* Function: tailstart
+ * -------------------
+ * Finds where the last count lines or bytes of a file start. Lines are
+ *	counted back from the end without reading the rest of the file.
+ *
+ * myfd: file descriptor for the file.
+ * count: number of lines or bytes.
+ * unit: 'l' (lines) or 'c' (bytes).
+ *
+ * returns: offset to start reading from.
+ */
+off_t tailstart(int myfd, long long count, char unit) {
+
+	/* Initialize variables. */
+	char buffer[TAIL_BUFLEN];
+	off_t end = lseek(myfd, 0, SEEK_END);
+	off_t pos = end;
+	long long seen = 0;
+
+	if (unit == 'c') return count < end ? end - count : 0;
+	if (count == 0 || end <= 0) return end;
+
+	/* Count newlines back from the end, a trailing one ends the last line rather than starting a new one. */
+	while (pos > 0) {
+		off_t rlen = pos < TAIL_BUFLEN ? pos : TAIL_BUFLEN;
+		pos -= rlen;
+		ssize_t rnum = pread(myfd, buffer, rlen, pos);
+		if (rnum <= 0) return 0;
+		for (ssize_t i = rnum - 1; i >= 0; i--) {
+			if (buffer[i] != '\n' || pos + i == end - 1) continue;
+			if (++seen == count) return pos + i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Function: sendavailable
+ * -----------------------
+ * Copies a file from its current offset to its end.
+ *
+ * myfd: file descriptor for the file.
+ * outfd: file descriptor to write to.
+ * buffer: buffer of TAIL_BUFLEN bytes.
+ *
+ * returns: number of bytes copied or -1 if outfd was closed.
+ */
+long long sendavailable(int myfd, int outfd, char * buffer) {
+	long long total = 0;
+	ssize_t rnum;
+	while ((rnum = read(myfd, buffer, TAIL_BUFLEN)) > 0) {
+		for (ssize_t index = 0; index < rnum; ) {
+			ssize_t wnum = write(outfd, buffer + index, rnum - index);
+			if (wnum == -1 && errno == EINTR) continue;
+			if (wnum == -1) return -1;
+			index += wnum;
+		}
+		total += rnum;
+	}
+	return total;
+}
+
+/* Function: tailfile
+ * ------------------
+ * Streams a file from a starting offset and then everything appended to
+ *	it, like tail -f, until the reader goes away. inotify reports changes so
+ *	the file is only read when it grows. A truncated file is sent again from
+ *	the start. When the path is renamed or deleted and a new file appears
+ *	in its place, the rest of the old file is sent and the new one is
+ *	followed from its start.
+ *
+ * session: session the path belongs to.
+ * myfd: file descriptor for the file (closed when done).
+ * path: path of the file.
+ * start: offset to start from.
+ * outfd: file descriptor to write to, a socket or the write end of a pipe.
+ * hostname: hostname for connection (for the log).
+ *
+ * returns: number of bytes sent.
+ */
+long long tailfile(struct session * session, int myfd, char * path, off_t start, int outfd, char * hostname) {
+
+	/* Initialize variables. */
+	char dir[PATH_MAX];
+	char * base = splitpath(path, dir);
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	uint32_t filemask = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+	long long total = 0;
+	char * buffer = malloc(TAIL_BUFLEN);
+	if (buffer == NULL) {
+		fprintf(stderr, "malloc (Server: tailfile): Out of memory\n");
+		exit(1);
+	}
+
+	/* Watch the file for changes and its directory for a replacement. */
+	int notifyfd = inotify_init1(IN_CLOEXEC);
+	checkerr(notifyfd, -1, "inotify_init1 (Server: tailfile)");
+	int dirfd = resolve(session, dir, O_PATH | O_DIRECTORY);
+	int filewd = watchfd(notifyfd, myfd, filemask);
+	int dirwd = dirfd == -1 ? -1 : watchfd(notifyfd, dirfd, IN_CREATE | IN_MOVED_TO);
+	if (filewd == -1 || dirwd == -1) {
+		logevent(LVL_WARN, hostname, "tail", -1, -1, "Cannot watch %s (%s)", path, strerror(errno));
+	}
+
+	lseek(myfd, start, SEEK_SET);
+
+	while (1) {
+
+		/* Send whatever was appended, starting over if the file was truncated. */
+		struct stat filestat;
+		checkerr(fstat(myfd, &filestat), -1, "fstat (Server: tailfile)");
+		if (filestat.st_size < lseek(myfd, 0, SEEK_CUR)) {
+			lseek(myfd, 0, SEEK_SET);
+			logevent(LVL_INFO, hostname, "tail", -1, -1, "%s was truncated", path);
+		}
+		long long sent = sendavailable(myfd, outfd, buffer);
+		if (sent == -1 || filewd == -1 || dirwd == -1) break;
+		total += sent;
+
+		/* Wait for the file to change or for the reader to go away. */
+		struct pollfd fds[2] = {{notifyfd, POLLIN, 0}, {outfd, POLLRDHUP, 0}};
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (fds[1].revents) break;
+
+		/* Look for signs that the path now names a different file. */
+		ssize_t len = read(notifyfd, events, sizeof(events));
+		int replaced = 0;
+		for (char * next = events; len > 0 && next < events + len; ) {
+			struct inotify_event * event = (struct inotify_event *)next;
+			if (event->wd == filewd && (event->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF))) replaced = 1;
+			if (event->wd == dirwd && event->len && strcmp(event->name, base) == 0) replaced = 1;
+			next += sizeof(struct inotify_event) + event->len;
+		}
+		if (!replaced) continue;
+
+		struct stat pathstat;
+		int newfd = resolve(session, path, O_RDONLY);
+		if (newfd == -1) continue;
+		if (fstat(newfd, &pathstat) == -1 || !S_ISREG(pathstat.st_mode) ||
+			(pathstat.st_dev == filestat.st_dev && pathstat.st_ino == filestat.st_ino)) {
+			close(newfd);
+			continue;
+		}
+
+		/* Finish the old file and follow the new one from its start. */
+		sent = sendavailable(myfd, outfd, buffer);
+		if (sent == -1) {
+			close(newfd);
+			break;
+		}
+		total += sent;
+		close(myfd);
+		myfd = newfd;
+		inotify_rm_watch(notifyfd, filewd);
+		filewd = watchfd(notifyfd, myfd, filemask);
+		logevent(LVL_INFO, hostname, "tail", -1, -1, "%s was replaced, following the new file", path);
+	}
+
+	if (dirfd != -1) close(dirfd);
+	close(notifyfd);
+	close(myfd);
+	free(buffer);
+	return total;
+}
+
+/* Structure: stream
+ * -----------------
+ * A protocol v2 data stream multiplexed over the control connection.
+ *	Outgoing streams read from fd and may send up to credit more bytes,
+ *	incoming streams write to fd and count the bytes consumed since the
+ *	last window update in credit. Sparse streams carry HOLE frames for the
+ *	holes in a file, skipped counts their bytes.
+ */
+struct stream {
+	uint32_t reqid;
+	uint8_t type;
+	int fd;
+	int outgoing;
+	long credit;
+	pid_t pid;
+	int sparse;
+	long long bytes;
+	long long skipped;
+	struct timespec start;
+	char name[PATH_MAX];
+};
+
+/* Function: findstream
+ * --------------------
+ * Finds the stream belonging to a request.
+ *
+ * streams: stream table.
+ * nstreams: number of streams in the table.
+ * reqid: request id to look for.
+ *
+ * returns: pointer to the stream or NULL if the request has no stream.
+ */
+struct stream * findstream(struct stream * streams, int nstreams, uint32_t reqid) {
+	for (int i = 0; i < nstreams; i++) {
+		if (streams[i].fd != -1 && streams[i].reqid == reqid) return &streams[i];
+	}
+	return NULL;
+}
+
+/* Function: closestream
+ * ---------------------
+ * Closes a stream, reaping its child process if it has one, and marks its
+ *	slot as free.
+ *
+ * mystream: stream to close.
+ *
+ * returns: void.
+ */
+void closestream(struct stream * mystream) {
+	close(mystream->fd);
+	if (mystream->pid > 0) waitpid(mystream->pid, NULL, 0);
+	mystream->fd = -1;
+	mystream->pid = 0;
+}
+
+/* Function: streamevent
+ * ----------------------
+ * Names the log event of a stream.
+ *
+ * mystream: stream to name.
+ *
+ * returns: name of the event.
+ */
+char * streamevent(struct stream * mystream) {
+	if (mystream->type == FRAME_GET) return "get";
+	if (mystream->type == FRAME_PUT) return "put";
+	if (mystream->type == FRAME_FIND) return "find";
+	if (mystream->type == FRAME_MIRROR) return "mirror";
+	if (mystream->type == FRAME_TAIL) return "tail";
+	return "ls";
+}
+
+/* Function: failstream
+ * --------------------
+ * Ends a stream that can't be completed: tells the client why, removes
+ *	what was received of an incoming file and closes the stream.
+ *
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for connection (for the log).
+ * session: session the stream belongs to.
+ * mystream: stream to end.
+ * errmsg: reason the stream failed.
+ *
+ * returns: void.
+ */
+void failstream(int connectfd, char * hostname, struct session * session, struct stream * mystream, char * errmsg) {
+	writeframe(connectfd, mystream->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+	logevent(LVL_ERROR, hostname, streamevent(mystream), mystream->bytes, microsince(&mystream->start), "%s", errmsg);
+	if (!mystream->outgoing) removefile(session, mystream->name, mystream->fd);
+	if (mystream->pid > 0) kill(mystream->pid, SIGTERM);
+	closestream(mystream);
+}
+
+/* Function: commandv2
+ * -------------------
+ * Handles a single protocol v2 request frame.
+ *
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for connection.
+ * session: session the request belongs to.
+ * frame: header of the request frame.
+ * payload: payload of the request frame.
+ * streams: stream table.
+ * nstreams: pointer to the number of streams in the table.
+ *
+ * returns: 0 if the client asked to quit, 1 otherwise.
+ */
+int commandv2(int connectfd, char * hostname, struct session * session, struct frame * frame, char * payload,
+	struct stream * streams, int * nstreams) {
+
+	/* Initialize variables. */
+	char errmsg[PATH_MAX + 64] = {0};
+	char ack[64] = {0};
+	uint8_t ackflags = 0;
+	struct stream * mystream = findstream(streams, *nstreams, frame->reqid);
+
+	/* Handle requests that open a new stream. */
+	if (frame->type == FRAME_LS || frame->type == FRAME_GET || frame->type == FRAME_PUT || frame->type == FRAME_FIND ||
+		frame->type == FRAME_MIRROR || frame->type == FRAME_TAIL) {
+
+		/* Make sure there is room for another stream. */
+		if (mystream != NULL || *nstreams >= MAX_STREAMS) {
+			snprintf(errmsg, sizeof(errmsg), "Too many outstanding requests");
+			writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+			return 1;
+		}
+
+		mystream = &streams[*nstreams];
+		memset(mystream, 0, sizeof(struct stream));
+		mystream->reqid = frame->reqid;
+		mystream->type = frame->type;
+		mystream->outgoing = frame->type != FRAME_PUT;
+		mystream->credit = mystream->outgoing ? FRAME_WINDOW : 0;
+		snprintf(mystream->name, PATH_MAX, "%s", payload);
+		clock_gettime(CLOCK_MONOTONIC, &mystream->start);
+
+		if (frame->type == FRAME_LS) {
+
+			/* Run ls -l with its output going to the stream. */
+			int outfd;
+			if (!(mystream->pid = forkstream(&mystream->fd, &outfd))) {
+				checkerr(dup2(outfd, STDOUT_FILENO), -1, "dup2 (Server: commandv2)");
+				close(outfd);
+				enterdir(session);
+				executecmd("ls", "-l");
+			}
+
+		} else if (frame->type == FRAME_FIND) {
+
+			/* Open the directory to search... */
+			struct findquery query;
+			int rootfd = -1;
+			if (parsefind(payload, &query) == -1) {
+				snprintf(errmsg, sizeof(errmsg), "Invalid search");
+			} else if ((rootfd = resolve(session, query.path, O_RDONLY | O_DIRECTORY)) == -1) {
+				snprintf(errmsg, sizeof(errmsg), "Invalid pathname %s", query.path);
+			}
+			if (rootfd == -1) {
+				writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+				logevent(LVL_WARN, hostname, "find", -1, -1, "%s", errmsg);
+				return 1;
+			}
+			snprintf(mystream->name, PATH_MAX, "%s", query.path);
+
+			/* ...and search it in a child with the matches going to the stream. */
+			int outfd;
+			if (!(mystream->pid = forkstream(&mystream->fd, &outfd))) {
+				findfiles(rootfd, &query, outfd);
+				exit(0);
+			}
+			close(rootfd);
+
+		} else if (frame->type == FRAME_MIRROR) {
+
+			/* Open the directory to mirror... */
+			int usecache, offset = 0, rootfd = -1;
+			if (sscanf(payload, "%d %n", &usecache, &offset) != 1 || !payload[offset]) {
+				snprintf(errmsg, sizeof(errmsg), "Invalid mirror request");
+			} else if ((rootfd = resolve(session, payload + offset, O_RDONLY | O_DIRECTORY)) == -1) {
+				snprintf(errmsg, sizeof(errmsg), "Invalid pathname %s", payload + offset);
+			}
+			if (rootfd == -1) {
+				writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+				logevent(LVL_WARN, hostname, "mirror", -1, -1, "%s", errmsg);
+				return 1;
+			}
+			snprintf(mystream->name, PATH_MAX, "%s", payload + offset);
+
+			/* ...and build its manifest in a child with the manifest going to the stream. */
+			int outfd;
+			if (!(mystream->pid = forkstream(&mystream->fd, &outfd))) {
+				sendmanifest(rootfd, usecache, outfd, hostname, mystream->name);
+				exit(0);
+			}
+			close(rootfd);
+
+		} else if (frame->type == FRAME_TAIL) {
+
+			/* Open the file to follow... */
+			long long count;
+			char unit;
+			char path[PATH_MAX];
+			int myfd = -1;
+			if (parsetail(payload, &count, &unit, path) == -1) snprintf(errmsg, sizeof(errmsg), "Invalid tail request");
+			else myfd = checkfile(session, path, O_RDONLY, errmsg, sizeof(errmsg));
+			if (myfd == -1) {
+				writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+				logevent(LVL_WARN, hostname, "tail", -1, -1, "%s", errmsg);
+				return 1;
+			}
+			snprintf(mystream->name, PATH_MAX, "%s", path);
+
+			/* ...and follow it in a child with the data going to the stream until the client cancels. */
+			int outfd;
+			if (!(mystream->pid = forkstream(&mystream->fd, &outfd))) {
+				sessionforget(session);
+				tailfile(session, myfd, path, tailstart(myfd, count, unit), outfd, hostname);
+				exit(0);
+			}
+			close(myfd);
+
+		} else {
+
+			/* Split off the size and mtime of the client's copy for a conditional get... */
+			char * path = payload;
+			long long size = -1, mtime = -1;
+			if (frame->type == FRAME_GET && (frame->flags & FRAME_COND)) {
+				int offset = 0;
+				if (sscanf(payload, "%lld %lld %n", &size, &mtime, &offset) != 2 || !payload[offset]) {
+					snprintf(errmsg, sizeof(errmsg), "Invalid conditional request");
+					writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+					logevent(LVL_WARN, hostname, "get", -1, -1, "%s", errmsg);
+					return 1;
+				}
+				path = payload + offset;
+				snprintf(mystream->name, PATH_MAX, "%s", path);
+			}
+
+			/* ...open the file for reading or for writing, creating it if it doesn't exist, failing otherwise... */
+			int flags = frame->type == FRAME_GET ? O_RDONLY : O_WRONLY | O_CREAT | O_EXCL;
+			mystream->fd = checkfile(session, path, flags, errmsg, sizeof(errmsg));
+			if (mystream->fd == -1) {
+				writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+				logevent(LVL_WARN, hostname, "open", -1, -1, "%s", errmsg);
+				return 1;
+			}
+			mystream->sparse = frame->flags & FRAME_SPARSE;
+			if (mystream->sparse) ackflags |= FRAME_SPARSE;
+
+			/* ...and skip sending it if the client's copy is current, telling the client what it gets otherwise. */
+			if (frame->type == FRAME_GET && (frame->flags & FRAME_COND)) {
+				struct stat filestat;
+				checkerr(fstat(mystream->fd, &filestat), -1, "fstat (Server: commandv2)");
+				long long filemtime = filestat.st_mtim.tv_sec * 1000000000LL + filestat.st_mtim.tv_nsec;
+				if (filestat.st_size == size && filemtime == mtime) {
+					close(mystream->fd);
+					mystream->fd = -1;
+					writeframe(connectfd, frame->reqid, FRAME_ACK, FRAME_COND, "=", 1);
+					logevent(LVL_INFO, hostname, "get", 0, microsince(&mystream->start), "%s not modified", path);
+					return 1;
+				}
+				snprintf(ack, 64, "%lld %lld", (long long)filestat.st_size, filemtime);
+				ackflags |= FRAME_COND;
+			}
+
+		}
+
+		(*nstreams)++;
+		writeframe(connectfd, frame->reqid, FRAME_ACK, ackflags, ack, strlen(ack));
+
+	} else if (frame->type == FRAME_CD) {
+
+		/* Try to change the session's working directory to pathname, sending appropriate errors if that
+		 * fails and the new working directory otherwise. */
+		char cwd[PATH_MAX];
+		if (changedir(session, payload) == -1) {
+			snprintf(errmsg, sizeof(errmsg), "Invalid pathname %s", payload);
+			writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+			logevent(LVL_WARN, hostname, "cd", -1, -1, "Invalid pathname %s", payload);
+		} else if (sessioncwd(session, cwd, PATH_MAX) == -1) {
+			snprintf(errmsg, sizeof(errmsg), "Cannot get working directory: %s", strerror(errno));
+			writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+			logevent(LVL_ERROR, hostname, "cd", -1, -1, "%s", errmsg);
+		} else {
+			writeframe(connectfd, frame->reqid, FRAME_ACK, 0, cwd, strlen(cwd));
+			logevent(LVL_INFO, hostname, "cd", -1, -1, "Changed current working directory to %s", payload);
+		}
+
+	} else if (frame->type == FRAME_DATA) {
+
+		/* Write incoming data to the file, handing credit back once half the window is used. */
+		if (mystream == NULL || mystream->outgoing) return 1;
+		if (writedata(mystream->fd, payload, frame->length) == -1) {
+			snprintf(errmsg, sizeof(errmsg), "Cannot write %s: %s", mystream->name, strerror(errno));
+			failstream(connectfd, hostname, session, mystream, errmsg);
+			return 1;
+		}
+		mystream->bytes += frame->length;
+		mystream->credit += frame->length;
+		if (mystream->credit >= FRAME_WINDOW / 2) {
+			uint32_t increment = htonl(mystream->credit);
+			writeframe(connectfd, frame->reqid, FRAME_WINDOWUPD, 0, &increment, 4);
+			mystream->credit = 0;
+		}
+
+	} else if (frame->type == FRAME_HOLE) {
+
+		/* Leave a hole in the file by skipping over it. */
+		uint64_t length;
+		if (mystream == NULL || mystream->outgoing || !mystream->sparse || frame->length != 8) return 1;
+		memcpy(&length, payload, 8);
+		if (lseek(mystream->fd, be64toh(length), SEEK_CUR) == -1) {
+			snprintf(errmsg, sizeof(errmsg), "Cannot write %s: %s", mystream->name, strerror(errno));
+			failstream(connectfd, hostname, session, mystream, errmsg);
+			return 1;
+		}
+		mystream->skipped += be64toh(length);
+
+	} else if (frame->type == FRAME_END) {
+
+		/* Extend the file over any trailing hole, set permissions on it, close it and tell the client it arrived. */
+		if (mystream == NULL || mystream->outgoing) return 1;
+		if (mystream->sparse && ftruncate(mystream->fd, lseek(mystream->fd, 0, SEEK_CUR)) == -1) {
+			snprintf(errmsg, sizeof(errmsg), "Cannot write %s: %s", mystream->name, strerror(errno));
+			failstream(connectfd, hostname, session, mystream, errmsg);
+			return 1;
+		}
+		fchmod(mystream->fd, S_IRUSR | S_IWUSR);
+		logevent(LVL_INFO, hostname, "put", mystream->bytes, microsince(&mystream->start),
+			"Received contents of %s (%lld bytes of holes)", mystream->name, mystream->skipped);
+		closestream(mystream);
+		writeframe(connectfd, frame->reqid, FRAME_ACK, 0, NULL, 0);
+
+	} else if (frame->type == FRAME_WINDOWUPD) {
+
+		/* The client consumed data, allow more to be sent. */
+		uint32_t increment;
+		if (mystream == NULL || !mystream->outgoing || frame->length != 4) return 1;
+		memcpy(&increment, payload, 4);
+		mystream->credit += ntohl(increment);
+
+	} else if (frame->type == FRAME_CANCEL) {
+
+		/* Stop the stream early and tell the client it is over. */
+		if (mystream == NULL) return 1;
+		if (mystream->type == FRAME_TAIL) {
+			logevent(LVL_INFO, hostname, "tail", mystream->bytes, microsince(&mystream->start),
+				"Followed %s", mystream->name);
+		}
+		if (mystream->pid > 0) kill(mystream->pid, SIGTERM);
+		closestream(mystream);
+		writeframe(connectfd, frame->reqid, FRAME_END, 0, NULL, 0);
+
+	} else if (frame->type == FRAME_QUIT) {
+
+		writeframe(connectfd, frame->reqid, FRAME_ACK, 0, NULL, 0);
+		return 0;
+
+	} else {
+
+		snprintf(errmsg, sizeof(errmsg), "Invalid request %c", frame->type);
+		writeframe(connectfd, frame->reqid, FRAME_ERR, 0, errmsg, strlen(errmsg));
+		logevent(LVL_WARN, hostname, "request", -1, -1, "Invalid request %c", frame->type);
+
+	}
+
+	return 1;
+}
+
+/* Function: serverhandlerv2
+ * -------------------------
+ * Handles a connection that negotiated protocol v2. Requests and the data
+ *	of every outstanding stream share the control connection, outgoing
+ *	streams are serviced one frame at a time so none of them starves.
+ *
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for connection.
+ * tuning: tuning profile of the connection.
+ * session: session of the connection.
+ *
+ * returns: void.
+ */
+void serverhandlerv2(int connectfd, char * hostname, struct tuning * tuning, struct session * session) {
+
+	/* Initialize variables. */
+	struct stream streams[MAX_STREAMS];
+	int nstreams = 0;
+	char * payload = malloc(FRAME_MAXLEN + 1);
+	char * chunk = malloc(FRAME_MAXLEN);
+	if (payload == NULL || chunk == NULL) {
+		fprintf(stderr, "malloc (Server: serverhandlerv2): Out of memory\n");
+		exit(1);
+	}
+
+	while (1) {
+
+		/* Wait for requests, or for outgoing streams with credit left to have data. */
+		struct pollfd fds[MAX_STREAMS + 1];
+		int index[MAX_STREAMS + 1];
+		int nfds = 1;
+		fds[0].fd = connectfd;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < nstreams; i++) {
+			if (streams[i].outgoing && streams[i].credit > 0) {
+				fds[nfds].fd = streams[i].fd;
+				fds[nfds].events = POLLIN;
+				index[nfds++] = i;
+			}
+		}
+		checkerr(poll(fds, nfds, -1), -1, "poll (Server: serverhandlerv2)");
+
+		/* Send one frame of data for every ready stream, as one batch. */
+		if (nfds > 1) corkframes(connectfd, tuning, 1);
+		for (int i = 1; i < nfds; i++) {
+			if (!fds[i].revents) continue;
+			struct stream * mystream = &streams[index[i]];
+			long rlen = mystream->credit < FRAME_MAXLEN ? mystream->credit : FRAME_MAXLEN;
+			ssize_t rnum;
+			if (mystream->sparse) {
+				off_t hole;
+				rnum = sparseread(mystream->fd, chunk, rlen, &hole);
+				if (hole > 0) {
+					uint64_t length = htobe64(hole);
+					writeframe(connectfd, mystream->reqid, FRAME_HOLE, 0, &length, 8);
+					mystream->skipped += hole;
+				}
+			} else {
+				rnum = read(mystream->fd, chunk, rlen);
+			}
+			if (rnum > 0) {
+				writeframe(connectfd, mystream->reqid, FRAME_DATA, 0, chunk, rnum);
+				mystream->bytes += rnum;
+				mystream->credit -= rnum;
+			} else if (rnum < 0) {
+				char errmsg[PATH_MAX + 64];
+				snprintf(errmsg, sizeof(errmsg), "Cannot read %s: %s", mystream->type == FRAME_LS ? "directory listing" :
+					mystream->name, strerror(errno));
+				failstream(connectfd, hostname, session, mystream, errmsg);
+			} else {
+				writeframe(connectfd, mystream->reqid, FRAME_END, 0, NULL, 0);
+				if (mystream->type == FRAME_GET) {
+					logevent(LVL_INFO, hostname, "get", mystream->bytes, microsince(&mystream->start),
+						"Sent contents of %s (%lld bytes of holes)", mystream->name, mystream->skipped);
+				} else if (mystream->type == FRAME_MIRROR) {
+					logevent(LVL_INFO, hostname, "mirror", mystream->bytes, microsince(&mystream->start),
+						"Sent manifest of %s", mystream->name);
+				} else if (mystream->type == FRAME_TAIL) {
+					logevent(LVL_INFO, hostname, "tail", mystream->bytes, microsince(&mystream->start),
+						"Followed %s", mystream->name);
+				} else if (mystream->type == FRAME_FIND) {
+					logevent(LVL_INFO, hostname, "find", mystream->bytes, microsince(&mystream->start),
+						"Sent search results for %s", mystream->name);
+				} else {
+					logevent(LVL_INFO, hostname, "ls", mystream->bytes, microsince(&mystream->start),
+						"Sent directory listing");
+				}
+				closestream(mystream);
+			}
+		}
+		if (nfds > 1) corkframes(connectfd, tuning, 0);
+
+		/* Handle the next request. */
+		if (fds[0].revents) {
+			struct frame frame;
+			if (!readframe(connectfd, &frame, payload)) break;
+			logevent(LVL_DEBUG, hostname, "request", frame.length, -1, "Request %c id %u", frame.type, frame.reqid);
+			if (!commandv2(connectfd, hostname, session, &frame, payload, streams, &nstreams)) break;
+		}
+
+		/* Drop closed streams from the table. */
+		int kept = 0;
+		for (int i = 0; i < nstreams; i++) {
+			if (streams[i].fd != -1) streams[kept++] = streams[i];
+		}
+		nstreams = kept;
+	}
+
+	/* Close anything still outstanding. */
+	for (int i = 0; i < nstreams; i++) {
+		if (streams[i].fd == -1) continue;
+		if (streams[i].pid > 0) kill(streams[i].pid, SIGTERM);
+		closestream(&streams[i]);
+	}
+	free(payload);
+	free(chunk);
+}
+
+/* Function: serverhandler
+ * -----------------
+ * Handles all incoming connections to the server.
+ *
+ * connectfd: file descriptor for connection.
+ * hostname: hostname for connection.
+ * tuning: tuning profile for data connections.
+ * root: directory to confine the session to (NULL or "" for none).
+ *
+ * returns: void.
+ */
+void serverhandler(int connectfd, char * hostname, struct tuning * tuning, char * root) {
+
+	int datafd = 0; // File descriptor for data socket.
+
+	/* Every path the client names is resolved by its session, never against the process working directory. */
+	struct session * session = malloc(sizeof(struct session));
+	if (session == NULL) {
+		fprintf(stderr, "malloc (Server: serverhandler): Out of memory\n");
+		exit(1);
+	}
+	if (sessioninit(session, root) == -1) {
+		logevent(LVL_ERROR, hostname, "connect", -1, -1, "Cannot open %s: %s", root != NULL && root[0] ? root : ".",
+			strerror(errno));
+		free(session);
+		return;
+	}
+
+	while (1) {
+
+		/* Initialize variables. */
+		char buffer [512] = {0};
+		char clientmsg [256] = {0};
+
+		/* Read the next command from the connection. */
+		readhandler(connectfd, buffer, 512);
+
+		/* Handle commands. */
+		if (buffer[0] == 'D') {
+
+			datafd = establishsocket(0, 1, tuning);
+			struct sockaddr_in dataAddr = getsocketinfo(datafd);
+			snprintf(clientmsg, 256, "A%hu\n", htons(dataAddr.sin_port)); // convert address from network byte order to host byte order.
+			msghandler(connectfd, clientmsg);
+
+		} else if (buffer[0] == 'C') {
+
+			/* Get pathname. */
+			char * path = strtok(buffer + 1, "\n");
+			if (path == NULL) path = "";
+
+			/* Try to change the session's working directory to pathname, sending appropriate errors if that fails. */
+			if (!*path || changedir(session, path) == -1) {
+				snprintf(clientmsg, 256, "EInvalid pathname %.200s\n", path);
+				msghandler(connectfd, clientmsg);
+				logevent(LVL_WARN, hostname, "cd", -1, -1, "Invalid pathname %s", path);
+			} else {
+				msghandler(connectfd, "A\n");
+				logevent(LVL_INFO, hostname, "cd", -1, -1, "Changed current working directory to %s", path);
+			}
+
+		} else if (buffer[0] == 'L') {
+
+			executels(datafd, tuning, session);
+			close(datafd);
+			msghandler(connectfd, "A\n");
+			logevent(LVL_INFO, hostname, "ls", -1, -1, "Sent directory listing");
+
+		} else if (buffer[0] == 'G') {
+
+			/* Get the filename. */
+			char * file = strtok(buffer + 1, "\n");
+			if (file == NULL) file = "";
+
+			/* Wait for connection with client. */
+			int dataconnfd = acceptconnection(datafd);
+			checkerr(applytuning(dataconnfd, tuning, TUNE_DATA), -1, "setsockopt (Server: serverhandler)");
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			/* Open the file for reading, continue if open fails. */
+			int myfd = openfile(connectfd, hostname, session, file, O_RDONLY);
+			if (myfd == -1) continue;
+
+			/* Read from the file and write to the data connection. */
+			long long bytes = readwrite(myfd, dataconnfd);
+
+			/* Close the data connection, the file, and the data socket. */
+			close(dataconnfd);
+			close(myfd);
+			close(datafd);
+
+			/* Log a confirmation server-side. */
+			if (bytes == -1) logevent(LVL_ERROR, hostname, "get", -1, microsince(&start), "Cannot send %s", file);
+			else logevent(LVL_INFO, hostname, "get", bytes, microsince(&start), "Sent contents of %s", file);
+
+		} else if (buffer[0] == 'P') {
+
+			/* Get the filename. */
+			char * file = strtok(buffer + 1, "\n");
+			if (file == NULL) file = "";
+
+			/* Wait for connection with client. */
+			int dataconnfd = acceptconnection(datafd);
+			checkerr(applytuning(dataconnfd, tuning, TUNE_DATA), -1, "setsockopt (Server: serverhandler)");
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			/* Open the file for writing, creating if it doesn't exit, failing otherwise. */
+			int myfd = openfile(connectfd, hostname, session, file, O_WRONLY | O_CREAT | O_EXCL);
+			if (myfd == -1) continue;
+
+			/* Read from the data connection and write to the file, removing what arrived if that fails. */
+			long long bytes = readwrite(dataconnfd, myfd);
+			if (bytes == -1) {
+				logevent(LVL_ERROR, hostname, "put", -1, microsince(&start), "Cannot receive %s: %s", file, strerror(errno));
+				removefile(session, file, myfd);
+			}
+
+			/* Close the data connection, set permissions on the file, close the file, and close the data socket. */
+			close(dataconnfd);
+			fchmod(myfd, S_IRUSR | S_IWUSR);
+			close(myfd);
+			close(datafd);
+
+			/* Log a confirmation server-side. */
+			if (bytes != -1) logevent(LVL_INFO, hostname, "put", bytes, microsince(&start), "Received contents of %s", file);
+
+		} else if (buffer[0] == 'F') {
+
+			/* Wait for connection with client. */
+			int dataconnfd = acceptconnection(datafd);
+			checkerr(applytuning(dataconnfd, tuning, TUNE_DATA), -1, "setsockopt (Server: serverhandler)");
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			/* Open the directory to search, sending appropriate errors if that fails. */
+			struct findquery query;
+			int rootfd = -1;
+			if (parsefind(buffer + 1, &query) == -1) {
+				snprintf(clientmsg, 256, "EInvalid search\n");
+			} else if ((rootfd = resolve(session, query.path, O_RDONLY | O_DIRECTORY)) == -1) {
+				snprintf(clientmsg, 256, "EInvalid pathname %.200s\n", query.path);
+			}
+			if (rootfd == -1) {
+				msghandler(connectfd, clientmsg);
+				clientmsg[strcspn(clientmsg, "\n")] = '\0';
+				logevent(LVL_WARN, hostname, "find", -1, -1, "%s", clientmsg + 1);
+				close(dataconnfd);
+				close(datafd);
+				continue;
+			}
+			msghandler(connectfd, "A\n");
+
+			/* Stream the matches over the data connection. */
+			long long matches = findfiles(rootfd, &query, dataconnfd);
+
+			/* Close the data connection, the directory, and the data socket. */
+			close(dataconnfd);
+			close(rootfd);
+			close(datafd);
+
+			/* Log a confirmation server-side. */
+			logevent(LVL_INFO, hostname, "find", -1, microsince(&start), "Found %lld matches under %s", matches, query.path);
+
+		} else if (buffer[0] == 'M') {
+
+			/* Wait for connection with client. */
+			int dataconnfd = acceptconnection(datafd);
+			checkerr(applytuning(dataconnfd, tuning, TUNE_DATA), -1, "setsockopt (Server: serverhandler)");
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			/* Open the directory to mirror, sending appropriate errors if that fails. */
+			char * path = strtok(buffer + 1, "\n");
+			int usecache, offset = 0, rootfd = -1;
+			if (path == NULL || sscanf(path, "%d %n", &usecache, &offset) != 1 || !path[offset]) {
+				snprintf(clientmsg, 256, "EInvalid mirror request\n");
+			} else if ((rootfd = resolve(session, path + offset, O_RDONLY | O_DIRECTORY)) == -1) {
+				snprintf(clientmsg, 256, "EInvalid pathname %.200s\n", path + offset);
+			}
+			if (rootfd == -1) {
+				msghandler(connectfd, clientmsg);
+				clientmsg[strcspn(clientmsg, "\n")] = '\0';
+				logevent(LVL_WARN, hostname, "mirror", -1, -1, "%s", clientmsg + 1);
+				close(dataconnfd);
+				close(datafd);
+				continue;
+			}
+			msghandler(connectfd, "A\n");
+
+			/* Send the manifest over the data connection. */
+			sendmanifest(rootfd, usecache, dataconnfd, hostname, path + offset);
+
+			/* Close the data connection, the directory, and the data socket. */
+			close(dataconnfd);
+			close(rootfd);
+			close(datafd);
+
+			/* Log a confirmation server-side. */
+			logevent(LVL_INFO, hostname, "mirror", -1, microsince(&start), "Sent manifest of %s", path + offset);
+
+		} else if (buffer[0] == 'T') {
+
+			/* Wait for connection with client. */
+			int dataconnfd = acceptconnection(datafd);
+			checkerr(applytuning(dataconnfd, tuning, TUNE_DATA), -1, "setsockopt (Server: serverhandler)");
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			/* Open the file to follow, continue if that fails. */
+			long long count;
+			char unit;
+			char path[PATH_MAX];
+			int myfd = -1;
+			if (parsetail(buffer + 1, &count, &unit, path) == -1) {
+				msghandler(connectfd, "EInvalid tail request\n");
+				logevent(LVL_WARN, hostname, "tail", -1, -1, "Invalid tail request");
+			} else {
+				myfd = openfile(connectfd, hostname, session, path, O_RDONLY);
+			}
+			if (myfd == -1) {
+				close(dataconnfd);
+				close(datafd);
+				continue;
+			}
+
+			/* Stream the file as it grows until the client closes the data connection. */
+			long long bytes = tailfile(session, myfd, path, tailstart(myfd, count, unit), dataconnfd, hostname);
+
+			/* Close the data connection and the data socket. */
+			close(dataconnfd);
+			close(datafd);
+
+			/* Log a confirmation server-side. */
+			logevent(LVL_INFO, hostname, "tail", bytes, microsince(&start), "Followed %s", path);
+
+		} else if (buffer[0] == 'V') {
+
+			/* Negotiate the protocol version, switching to framed requests for v2. */
+			int version = atoi(buffer + 1) < PROTO_VERSION ? atoi(buffer + 1) : PROTO_VERSION;
+			if (version < 1) version = 1;
+			snprintf(clientmsg, 256, "A%d\n", version);
+			msghandler(connectfd, clientmsg);
+			logevent(LVL_INFO, hostname, "negotiate", -1, -1, "Using protocol v%d", version);
+			if (version >= 2) {
+				checkerr(applytuning(connectfd, tuning, TUNE_STREAM), -1, "setsockopt (Server: serverhandler)");
+				serverhandlerv2(connectfd, hostname, tuning, session);
+				break;
+			}
+
+		} else if (buffer[0] == 'Q') {
+
+			msghandler(connectfd, "A\n");
+			break;
+
+		} else {
+
+			snprintf(clientmsg, 256, "EInvalid input %.200s\n", buffer);
+			msghandler(connectfd, clientmsg);
+			logevent(LVL_WARN, hostname, "request", -1, -1, "Invalid input %s", buffer);
+
+		}
+	}
+
+	sessionclose(session);
+	free(session);
+}
+
+/* Structure: listener
+ * -------------------
+ * A listening port and the tuning profile its sessions use.
+ */
+struct listener {
+	unsigned short port;
+	char profile[32];
+	int fd;
+};
+
+/* Structure: config
+ * -----------------
+ * Server configuration, see readconfig.
+ */
+struct config {
+	int backlog;
+	int maxsessions;
+	char logpath[256];
+	int loglevel;
+	char root[PATH_MAX];
+	int nlisteners;
+	struct listener listeners[MAX_LISTENERS];
+	int nprofiles;
+	struct tuning profiles[MAX_PROFILES];
+};
+
+/* Function: readconfig
+ * --------------------
+ * Reads the server configuration. The file holds a [server] section
+ *	(backlog, max_sessions, log_file, log_level, root), one [listener] section
+ *	per listening port (port, profile) and [profile <name>] sections
+ *	(sndbuf, rcvbuf, nodelay, cork, notsent_lowat) that add to or change
+ *	the built-in default, lan and wan profiles. Other sections are left for
+ *	the client. Without a file, or without listeners, the server listens on
+ *	PORT_NUM with the default profile.
+ *
+ * path: configuration file or NULL for the built-in defaults.
+ * config: structure to fill in.
+ * errmsg: buffer for an error message.
+ * errlen: length of errmsg.
+ *
+ * returns: 0 on success, -1 on error.
+ */
+int readconfig(char * path, struct config * config, char * errmsg, int errlen) {
+
+	/* Initialize variables. */
+	char line[CONFIG_LINELEN];
+	char section[CONFIG_LINELEN] = "";
+	char * key;
+	char * value;
+	int lineno = 0;
+	int result;
+	FILE * file = NULL;
+
+	memset(config, 0, sizeof(struct config));
+	config->backlog = 4;
+	config->loglevel = LVL_INFO;
+	config->nprofiles = defaultprofiles(config->profiles);
+
+	if (path != NULL && (file = fopen(path, "r")) == NULL) {
+		snprintf(errmsg, errlen, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (file != NULL && (result = nextoption(file, section, &key, &value, line, &lineno)) != 0) {
+
+		if (result == -1) break;
+
+		if (key == NULL) {
+
+			/* Start a new listener or profile. */
+			if (strcmp(section, "listener") == 0) {
+				if (config->nlisteners == MAX_LISTENERS) break;
+				struct listener * mylistener = &config->listeners[config->nlisteners++];
+				mylistener->port = PORT_NUM;
+				mylistener->fd = -1;
+				snprintf(mylistener->profile, 32, "default");
+			} else if (strncmp(section, "profile ", 8) == 0) {
+				if (findprofile(config->profiles, config->nprofiles, section + 8) != NULL) continue;
+				if (config->nprofiles == MAX_PROFILES || strlen(section + 8) >= sizeof(config->profiles[0].name)) break;
+				struct tuning * profile = &config->profiles[config->nprofiles++];
+				memset(profile, 0, sizeof(struct tuning));
+				strcpy(profile->name, section + 8);
+			}
+			continue;
+
+		}
+
+		if (strcmp(section, "server") == 0) {
+
+			if (strcmp(key, "backlog") == 0 && atoi(value) > 0) config->backlog = atoi(value);
+			else if (strcmp(key, "max_sessions") == 0 && atoi(value) >= 0) config->maxsessions = atoi(value);
+			else if (strcmp(key, "log_file") == 0) snprintf(config->logpath, 256, "%s", value);
+			else if (strcmp(key, "log_level") == 0 && loglevel(value) != -1) config->loglevel = loglevel(value);
+			else if (strcmp(key, "root") == 0) snprintf(config->root, PATH_MAX, "%s", value);
+			else break;
+
+		} else if (strcmp(section, "listener") == 0) {
+
+			struct listener * mylistener = &config->listeners[config->nlisteners - 1];
+			if (strcmp(key, "port") == 0 && atoi(value) > 0 && atoi(value) < 65536) mylistener->port = atoi(value);
+			else if (strcmp(key, "profile") == 0) snprintf(mylistener->profile, 32, "%s", value);
+			else break;
+
+		} else if (strncmp(section, "profile ", 8) == 0) {
+
+			if (settuning(findprofile(config->profiles, config->nprofiles, section + 8), key, value) == -1) break;
+
+		}
+	}
+
+	if (file != NULL) {
+		int failed = !feof(file);
+		fclose(file);
+		if (failed) {
+			snprintf(errmsg, errlen, "%s:%d: Invalid or unsupported setting", path, lineno);
+			return -1;
+		}
+	}
+
+	/* Fall back to the default listener and check every listener has a profile. */
+	if (!config->nlisteners) {
+		config->listeners[0].port = PORT_NUM;
+		config->listeners[0].fd = -1;
+		snprintf(config->listeners[0].profile, 32, "default");
+		config->nlisteners = 1;
+	}
+	for (int i = 0; i < config->nlisteners; i++) {
+		if (findprofile(config->profiles, config->nprofiles, config->listeners[i].profile) == NULL) {
+			snprintf(errmsg, errlen, "%s: Unknown profile %s", path, config->listeners[i].profile);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Function: openlistener
+ * ----------------------
+ * Establishes a passive socket for a listener. Unlike establishsocket,
+ *	failures are logged rather than fatal so a bad reload cannot take the
+ *	server down.
+ *
+ * port: port number for the socket.
+ * backlog: backlog for the passive socket.
+ * tuning: tuning profile for the listener.
+ *
+ * returns: file descriptor for the new socket or -1 on error.
+ */
+int openlistener(unsigned short port, int backlog, struct tuning * tuning) {
+
+	/* Create socket. */
+	int socketfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (socketfd == -1) {
+		logevent(LVL_ERROR, NULL, "listen", -1, -1, "socket: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Set the family, port number, and address for the socket. */
+	struct sockaddr_in servAddr;
+	memset(&servAddr, 0, sizeof(servAddr)); // Zero out servAdr.
+	servAddr.sin_family = AF_INET;
+	servAddr.sin_port = htons(port);
+	servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	/* Allow rebinding while old connections linger and size the buffers accepted connections inherit. */
+	int reuse = 1;
+	setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (applytuning(socketfd, tuning, TUNE_LISTEN) == -1) {
+		logevent(LVL_ERROR, NULL, "listen", -1, -1, "Cannot apply profile %s to port %hu: %s", tuning->name, port,
+			strerror(errno));
+		close(socketfd);
+		return -1;
+	}
+
+	/* Bind the socket and set it as passive (listening). */
+	if (bind(socketfd, (struct sockaddr *)&servAddr, (socklen_t)sizeof(servAddr)) == -1 ||
+		listen(socketfd, backlog) == -1) {
+		logevent(LVL_ERROR, NULL, "listen", -1, -1, "Cannot listen on port %hu: %s", port, strerror(errno));
+		close(socketfd);
+		return -1;
+	}
+
+	logevent(LVL_INFO, NULL, "listen", -1, -1, "Listening on port %hu (profile %s)", port, tuning->name);
+	return socketfd;
+}
+
+/* Function: openlisteners
+ * -----------------------
+ * Opens the listeners of a configuration, taking over the sockets of an
+ *	older configuration for ports that are still in use and closing the
+ *	rest. Live sessions are never touched.
+ *
+ * config: new configuration.
+ * old: (optional) configuration being replaced.
+ *
+ * returns: number of open listeners.
+ */
+int openlisteners(struct config * config, struct config * old) {
+
+	int open = 0;
+
+	for (int i = 0; i < config->nlisteners; i++) {
+
+		struct listener * mylistener = &config->listeners[i];
+		struct tuning * tuning = findprofile(config->profiles, config->nprofiles, mylistener->profile);
+
+		/* Reuse the socket if the port was already open, updating its backlog and buffers. */
+		for (int j = 0; old != NULL && j < old->nlisteners; j++) {
+			if (old->listeners[j].port == mylistener->port && old->listeners[j].fd != -1) {
+				mylistener->fd = old->listeners[j].fd;
+				old->listeners[j].fd = -1;
+				listen(mylistener->fd, config->backlog);
+				if (applytuning(mylistener->fd, tuning, TUNE_LISTEN) == -1) {
+					logevent(LVL_WARN, NULL, "listen", -1, -1, "Cannot apply profile %s to port %hu: %s", tuning->name,
+						mylistener->port, strerror(errno));
+				}
+				break;
+			}
+		}
+
+		if (mylistener->fd == -1) mylistener->fd = openlistener(mylistener->port, config->backlog, tuning);
+		if (mylistener->fd != -1) open++;
+	}
+
+	/* Close listeners that are gone from the new configuration. */
+	for (int j = 0; old != NULL && j < old->nlisteners; j++) {
+		if (old->listeners[j].fd != -1) {
+			logevent(LVL_INFO, NULL, "listen", -1, -1, "Closed port %hu", old->listeners[j].port);
+			close(old->listeners[j].fd);
+			old->listeners[j].fd = -1;
+		}
+	}
+
+	return open;
+}
+
+/* Function: reloadconfig
+ * ----------------------
+ * Rereads the configuration file and applies it to the listeners and the
+ *	log. A configuration that can't be read is logged and ignored.
+ *
+ * path: configuration file (may be NULL).
+ * config: current configuration, replaced on success.
+ * cli: configuration holding the log settings given on the command line.
+ *
+ * returns: void.
+ */
+void reloadconfig(char * path, struct config * config, struct config * cli) {
+
+	/* Initialize variables. */
+	char errmsg[256] = {0};
+	struct config newconfig;
+
+	if (readconfig(path, &newconfig, errmsg, 256) == -1) {
+		logevent(LVL_ERROR, NULL, "reload", -1, -1, "%s, keeping the current configuration", errmsg);
+		return;
+	}
+	if (cli->logpath[0]) snprintf(newconfig.logpath, 256, "%s", cli->logpath);
+	if (cli->loglevel != -1) newconfig.loglevel = cli->loglevel;
+
+	openlisteners(&newconfig, config);
+	*config = newconfig;
+
+	/* Reopen the log so it can be rotated, and apply the new level to every session. */
+	logreopen(config->logpath[0] ? config->logpath : NULL);
+	atomic_store(&logring->level, config->loglevel);
+	logevent(LVL_INFO, NULL, "reload", -1, -1, "Reloaded configuration");
+}
+
+/* Function: hanguphandler
+ * ------------------------
+ * SIGHUP handler, asks the main loop to reload the configuration.
+ *
+ * signum: signal number.
+ *
+ * returns: void.
+ */
+void hanguphandler(int signum) {
+	(void)signum;
+	reload = 1;
+}
+
+/* Main Function */
+int main(int argc, char * argv[]) {
+
+	/* Initialize variables. */
+	char errmsg[256] = {0};
+	char * configpath = NULL;
+	struct config config;
+	struct config cli = {.loglevel = -1};
+	int nsessions = 0;
+
+	/* Parse options, log settings given here override the configuration file. */
+	int opt;
+	while ((opt = getopt(argc, argv, "c:l:L:")) != -1) {
+		if (opt == 'c') configpath = optarg;
+		else if (opt == 'l') snprintf(cli.logpath, 256, "%s", optarg);
+		else if (opt == 'L' && loglevel(optarg) != -1) cli.loglevel = loglevel(optarg);
+		else {
+			printf("Usage: %s [-c <config file>] [-l <log file>] [-L debug|info|warn|error]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* Read the configuration. */
+	if (readconfig(configpath, &config, errmsg, 256) == -1) {
+		fprintf(stderr, "readconfig (Server: main): %s\n", errmsg);
+		exit(1);
+	}
+	if (cli.logpath[0]) snprintf(config.logpath, 256, "%s", cli.logpath);
+	if (cli.loglevel != -1) config.loglevel = cli.loglevel;
+
+	/* A vanished log reader or client should fail a write, not kill the server. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Reload the configuration on SIGHUP. The signal stays blocked except while waiting in ppoll,
+	 *	so one that arrives after the reload check still interrupts the wait. Blocking it before the
+	 *	log writer starts keeps that thread from taking it. */
+	struct sigaction action;
+	sigset_t hangup, waitmask;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = hanguphandler;
+	checkerr(sigaction(SIGHUP, &action, NULL), -1, "sigaction (Server: main)");
+	sigemptyset(&hangup);
+	sigaddset(&hangup, SIGHUP);
+	checkerr(sigprocmask(SIG_BLOCK, &hangup, &waitmask), -1, "sigprocmask (Server: main)");
+	sigdelset(&waitmask, SIGHUP);
+
+	/* Start the log writer before any session is forked. */
+	loginit(config.logpath[0] ? config.logpath : NULL, config.loglevel);
+
+	/* Establish passive sockets. */
+	if (!openlisteners(&config, NULL)) {
+		fprintf(stderr, "openlisteners (Server: main): No listeners could be opened\n");
+		exit(1);
+	}
+
+	while (1) {
+
+		/* Reload the configuration if asked to. */
+		if (reload) {
+			reload = 0;
+			reloadconfig(configpath, &config, &cli);
+		}
+
+		/* Wait for connection. */
+		struct pollfd fds[MAX_LISTENERS];
+		for (int i = 0; i < config.nlisteners; i++) {
+			fds[i].fd = config.listeners[i].fd; // Closed listeners (-1) are ignored by poll.
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+		if (ppoll(fds, config.nlisteners, NULL, &waitmask) == -1) {
+			if (errno != EINTR) checkerr(-1, -1, "ppoll (Server: main)");
+			continue;
+		}
+
+		/* Get rid of zombies. */
+		while (waitpid(-1, NULL, WNOHANG) > 0) nsessions--;
+
+		for (int i = 0; i < config.nlisteners; i++) {
+
+			if (!(fds[i].revents & POLLIN)) continue;
+			struct listener * mylistener = &config.listeners[i];
+			int connectfd = acceptconnection(mylistener->fd);
+
+			/* Turn the connection away if the server is full. */
+			if (config.maxsessions && nsessions >= config.maxsessions) {
+				msghandler(connectfd, "EServer busy, try again later\n");
+				logevent(LVL_WARN, NULL, "connect", -1, -1, "Refused connection on port %hu, %d sessions active",
+					mylistener->port, nsessions);
+				close(connectfd);
+				continue;
+			}
+
+			/* Fork... */
+			pid_t pid = fork();
+			checkerr(pid, -1, "fork (Server: main)");
+
+			/* ...and handle the connection in the child. */
+			if (!pid) {
+				struct timespec start;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+
+				/* The session keeps its profile across reloads and leaves the listeners to the parent. */
+				struct tuning tuning = *findprofile(config.profiles, config.nprofiles, mylistener->profile);
+				signal(SIGHUP, SIG_IGN);
+				checkerr(sigprocmask(SIG_SETMASK, &waitmask, NULL), -1, "sigprocmask (Server: main)");
+				for (int j = 0; j < config.nlisteners; j++) {
+					if (config.listeners[j].fd != -1) close(config.listeners[j].fd);
+				}
+				checkerr(applytuning(connectfd, &tuning, TUNE_CONTROL), -1, "setsockopt (Server: main)");
+
+				struct sockaddr_in clientAddr = getsocketinfo(connectfd);
+				struct hostent * hostEntry;
+				if((hostEntry = gethostbyaddr(&(clientAddr.sin_addr), sizeof(struct in_addr), AF_INET)) == NULL) {
+					herror("gethostbyaddr (Server: main)");
+					exit(1);
+				}
+				logevent(LVL_INFO, hostEntry->h_name, "connect", -1, -1, "Connection received");
+				serverhandler(connectfd, hostEntry->h_name, &tuning, config.root);
+				logevent(LVL_INFO, hostEntry->h_name, "close", -1, microsince(&start), "Closing connection");
+				close(connectfd); // Close the connection in the child.
+				exit(0);
+			}
+
+			/* Close the connection in the parent. */
+			nsessions++;
+			close(connectfd);
+		}
 	}
 
 	return 0;